@@ -0,0 +1,73 @@
+#ifndef ROUGH_OCTOMAP_BIT_STREAM_H
+#define ROUGH_OCTOMAP_BIT_STREAM_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace octomap {
+
+  // Appends bit fields LSB first to a growable byte buffer
+  class BitWriter {
+  public:
+    BitWriter(std::vector<char>& buf) : buf(buf), acc(0), acc_bits(0) {}
+
+    // Append the low n bits of v (n <= 32, higher bits of v must be zero)
+    inline void write(uint64_t v, unsigned int n) {
+      acc |= v << acc_bits;
+      acc_bits += n;
+      while (acc_bits >= 8) {
+        buf.push_back((char)acc);
+        acc >>= 8;
+        acc_bits -= 8;
+      }
+    }
+
+    // Pad the last partial byte with zeros
+    inline void flush() {
+      if (acc_bits) {
+        buf.push_back((char)acc);
+        acc = 0;
+        acc_bits = 0;
+      }
+    }
+
+  protected:
+    std::vector<char>& buf;
+    uint64_t acc;
+    unsigned int acc_bits;
+  };
+
+  // Reads bit fields written by BitWriter. Reading past the end yields zeros and sets overrun().
+  class BitReader {
+  public:
+    BitReader(const char* data, const char* end) : data(data), end(end), acc(0), acc_bits(0), past_end(false) {}
+
+    // Read the next n bits (n <= 32)
+    inline uint64_t read(unsigned int n) {
+      while (acc_bits < n) {
+        if (data != end) acc |= (uint64_t)(unsigned char)*data++ << acc_bits;
+        else past_end = true;
+        acc_bits += 8;
+      }
+      const uint64_t v = acc & ((1ull << n) - 1);
+      acc >>= n;
+      acc_bits -= n;
+      return v;
+    }
+
+    inline bool overrun() const { return past_end; }
+
+    // First byte not yet touched; the rest of a partially read byte is padding
+    inline const char* position() const { return data; }
+
+  protected:
+    const char* data;
+    const char* end;
+    uint64_t acc;
+    unsigned int acc_bits;
+    bool past_end;
+  };
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ROUGH_OCTOMAP_COMPRESSION_H
+#define ROUGH_OCTOMAP_COMPRESSION_H
+
+#include <stdint.h>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace octomap {
+
+  // General-purpose compression applied on top of the binary encoding of a map message
+  enum RoughCompressionMode {
+    NO_COMPRESSION,
+    ZSTD_COMPRESSION
+  };
+
+  // False if the library was built without support for mode
+  bool compressionAvailable(RoughCompressionMode mode);
+
+  // Message id suffix signalling mode ("" for NO_COMPRESSION)
+  std::string compressionSuffix(RoughCompressionMode mode);
+
+  // Strips a trailing compression suffix from id and returns the mode it signals
+  RoughCompressionMode stripCompressionSuffix(std::string& id);
+
+  // Output stream buffer that compresses everything written through it and appends the
+  // compressed bytes to out. Call finish() after the last write to close the frame.
+  class CompressingBuffer : public std::streambuf {
+  public:
+    CompressingBuffer(std::vector<int8_t>& out, RoughCompressionMode mode, int level = 3);
+    ~CompressingBuffer();
+
+    // Returns false if anything written so far could not be compressed
+    bool finish();
+
+  protected:
+    int_type overflow(int_type c);
+    std::streamsize xsputn(const char* s, std::streamsize n);
+    int sync();
+
+    bool compress(const char* data, size_t size, bool end);
+    bool flushPending();
+
+    std::vector<int8_t>& out;
+    std::vector<char> pending;
+    void* ctx;
+    bool failed;
+    bool finished;
+  };
+
+  // Input stream buffer that decompresses data chunk by chunk as it is read
+  class DecompressingBuffer : public std::streambuf {
+  public:
+    DecompressingBuffer(const char* data, size_t size, RoughCompressionMode mode);
+    ~DecompressingBuffer();
+
+    // True if the compressed data was corrupt or truncated
+    bool failed() const { return error; }
+
+  protected:
+    int_type underflow();
+
+    const char* data;
+    size_t size;
+    size_t pos;
+    std::vector<char> chunk;
+    void* ctx;
+    bool error;
+    bool frame_done;
+  };
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef ROUGH_OCTOMAP_RANGE_CODER_H
+#define ROUGH_OCTOMAP_RANGE_CODER_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace octomap {
+
+  // Adaptive binary range coder (the LZMA scheme). Each context keeps an 11-bit probability of
+  // the next bit being 0, which moves 1/32 of the way towards every coded bit.
+  namespace range_coding {
+    typedef uint16_t Prob;
+    const unsigned int prob_bits = 11;
+    const Prob prob_init = 1 << (prob_bits - 1);
+    const unsigned int move_bits = 5;
+    const uint32_t top = 1u << 24;
+  }
+
+  class RangeEncoder {
+  public:
+    RangeEncoder(std::vector<char>& buf) : buf(buf), low(0), range(0xFFFFFFFF), cache(0), cache_size(1) {}
+
+    inline void encode(range_coding::Prob& p, unsigned int bit) {
+      const uint32_t bound = (range >> range_coding::prob_bits) * p;
+      if (!bit) {
+        range = bound;
+        p += ((1 << range_coding::prob_bits) - p) >> range_coding::move_bits;
+      }
+      else {
+        low += bound;
+        range -= bound;
+        p -= p >> range_coding::move_bits;
+      }
+      while (range < range_coding::top) {
+        range <<= 8;
+        shiftLow();
+      }
+    }
+
+    // Code the low num_bits of v MSB first through a binary tree of contexts (probs[1 << num_bits])
+    inline void encodeTree(range_coding::Prob* probs, uint32_t v, unsigned int num_bits) {
+      uint32_t m = 1;
+      for (unsigned int i=num_bits; i>0; i--) {
+        const unsigned int bit = (v >> (i - 1)) & 1;
+        encode(probs[m], bit);
+        m = (m << 1) | bit;
+      }
+    }
+
+    inline void flush() {
+      for (int i=0; i<5; i++) shiftLow();
+    }
+
+  protected:
+    inline void shiftLow() {
+      if ((uint32_t)low < 0xFF000000u || (low >> 32) != 0) {
+        unsigned char carry = (unsigned char)(low >> 32);
+        unsigned char temp = cache;
+        do {
+          buf.push_back((char)(unsigned char)(temp + carry));
+          temp = 0xFF;
+        } while (--cache_size != 0);
+        cache = (unsigned char)(low >> 24);
+      }
+      cache_size++;
+      low = (low & 0x00FFFFFF) << 8;
+    }
+
+    std::vector<char>& buf;
+    uint64_t low;
+    uint32_t range;
+    unsigned char cache;
+    uint64_t cache_size;
+  };
+
+  class RangeDecoder {
+  public:
+    // Reading past end yields zeros and sets overrun()
+    RangeDecoder(const char* data, const char* end) : data(data), end(end), range(0xFFFFFFFF), code(0), past_end(false) {
+      for (int i=0; i<5; i++) code = (code << 8) | nextByte();
+    }
+
+    inline unsigned int decode(range_coding::Prob& p) {
+      const uint32_t bound = (range >> range_coding::prob_bits) * p;
+      unsigned int bit;
+      if (code < bound) {
+        range = bound;
+        p += ((1 << range_coding::prob_bits) - p) >> range_coding::move_bits;
+        bit = 0;
+      }
+      else {
+        code -= bound;
+        range -= bound;
+        p -= p >> range_coding::move_bits;
+        bit = 1;
+      }
+      while (range < range_coding::top) {
+        range <<= 8;
+        code = (code << 8) | nextByte();
+      }
+      return bit;
+    }
+
+    inline uint32_t decodeTree(range_coding::Prob* probs, unsigned int num_bits) {
+      uint32_t m = 1;
+      for (unsigned int i=0; i<num_bits; i++) {
+        m = (m << 1) | decode(probs[m]);
+      }
+      return m - (1u << num_bits);
+    }
+
+    inline bool overrun() const { return past_end; }
+    inline const char* position() const { return data; }
+
+  protected:
+    inline unsigned char nextByte() {
+      if (data != end) return (unsigned char)*data++;
+      past_end = true;
+      return 0;
+    }
+
+    const char* data;
+    const char* end;
+    uint32_t range;
+    uint32_t code;
+    bool past_end;
+  };
+
+}
+
+#endif
@@ -1,9 +1,19 @@
 #ifndef OCTOMAP_ROUGH_OCTREE_H
 #define OCTOMAP_ROUGH_OCTREE_H
 
+#include <algorithm>
+#include <bitset>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <boost/dynamic_bitset.hpp>
 
+#include <rough_octomap/BitStream.h>
+#include <rough_octomap/RangeCoder.h>
+
 #include <octomap/OcTreeNode.h>
 #include <octomap/OcTreeStamped.h>
 #include <octomap/OccupancyOcTreeBase.h>
@@ -106,7 +116,16 @@ inline RGBColor ratioToRGB(float ratio)
 namespace octomap {
   enum RoughBinaryEncodingMode {
     THRESHOLDING,
-    BINNING
+    BINNING,
+    VARIABLE_BINNING, // binning, but rough/stair bits only for occupied leaf children
+    ARITHMETIC_CODING, // binning content, entropy coded with context modelling
+    PROGRESSIVE_BINNING // binning records level by level, every prefix decodes to a coarser map
+  };
+
+  // Point cloud formats of RoughOcTree::writeOccupiedPoints, both binary
+  enum RoughPointFormat {
+    PLY_POINTS,
+    PCD_POINTS
   };
 }
 
@@ -279,6 +298,7 @@ namespace octomap {
   public:
     /// Default constructor, sets resolution of leafs
     RoughOcTree(double resolution);
+    ~RoughOcTree();
 
     /// virtual constructor: creates a new object of same type
     /// (Covariant return type requires an up-to-date compiler)
@@ -287,7 +307,7 @@ namespace octomap {
     std::string getTreeType() const {return "RoughOcTree";}
 
     inline void updateNumBitsPerNode() {
-      this->num_bits_per_node = 2 + this->num_rough_bits + 1*((int)getStairsEnabled());
+      this->num_bits_per_node = 2 + this->num_rough_bits + binaryStairBits();
     }
 
     inline bool getRoughEnabled() const { return roughEnabled; }
@@ -299,8 +319,10 @@ namespace octomap {
       else if (!this->num_binary_bins) this->num_binary_bins = this->binary_bins_to_use;
       // Reset the bits calculations
       if (this->num_binary_bins) this->binsize = 1.0 / (this->num_binary_bins - 1);
-      this->num_rough_bits = log2(this->num_binary_bins);
+      this->num_rough_bits = this->num_binary_bins ? log2(this->num_binary_bins) : 0;
       updateNumBitsPerNode();
+      // A quantization table only fits the bin count it was made for
+      if (this->rough_bin_values.size() != this->num_binary_bins) setUniformRoughQuantization();
     }
 
     inline bool getStairsEnabled() const { return stairsEnabled; }
@@ -309,8 +331,28 @@ namespace octomap {
       updateNumBitsPerNode();
     }
 
+    // Width of the stair field of binning records. One bit is just whether the node is stairs;
+    // more bits also keep how far its log-odds are from stairs_prob_thres_log, so receivers can
+    // fuse further evidence. Variable-width and arithmetic coded streams keep a single bit.
+    // A wider field is signalled in the binary header, which is then always written.
+    inline uint getStairBits() const { return num_stair_bits; }
+    inline void setStairBits(uint n) {
+      if (n < 1 || n > max_stair_bits) {
+        OCTOMAP_ERROR("Number of stair bits must be between 1 and %u, got %u.\n", max_stair_bits, n);
+        return;
+      }
+      this->num_stair_bits = n;
+      updateNumBitsPerNode();
+    }
+    // Stair bits per child in binning records
+    inline uint binaryStairBits() const { return stairsEnabled ? num_stair_bits : 0; }
+
     inline uint getNumBins() const { return num_binary_bins; }
     inline void setNumBins(uint n) {
+      if (n > max_binary_bins || (n & (n - 1))) {
+        OCTOMAP_ERROR("Number of bins must be a power of 2 no larger than %u, got %u.\n", max_binary_bins, n);
+        return;
+      }
       this->num_binary_bins = n;
       if (n) setRoughEnabled(true);
     }
@@ -347,6 +389,11 @@ namespace octomap {
      * @return true if pruning was successful
      */
     virtual bool pruneNode(RoughOcTreeNode* node);
+    // Within a keyed update, pruneNode and expandNode find the node on the path to the key and
+    // keep the depth counts up to date. Elsewhere the path is not known, so they drop the cached
+    // subtree hashes and the depth counts. prune() keeps the counts and drops the hashes once.
+    virtual void expandNode(RoughOcTreeNode* node);
+    virtual void prune();
 
     virtual bool isNodeCollapsible(const RoughOcTreeNode* node) const;
 
@@ -499,29 +546,492 @@ namespace octomap {
     std::ostream& writeBinaryNode(std::ostream &s, const RoughOcTreeNode* node);
     std::istream& readBinaryNodeViaThresholding(std::istream &s, RoughOcTreeNode* node);
     std::ostream& writeBinaryNodeViaThresholding(std::ostream &s, const RoughOcTreeNode* node);
-    std::istream& readBinaryNodeViaBinning(std::istream &s, RoughOcTreeNode* node);
+    std::istream& readBinaryNodeViaBinning(std::istream &s, RoughOcTreeNode* node,
+                                           const OcTreeKey* bbx_min = NULL, const OcTreeKey* bbx_max = NULL);
     std::ostream& writeBinaryNodeViaBinning(std::ostream &s, const RoughOcTreeNode* node);
 
+    // Restricts what the binning encoder writes. Children failing a filter are written as unknown
+    // and not descended into, and inner nodes left with nothing are dropped.
+    struct BinaryFilter {
+      const OcTreeKey* bbx_min = NULL; // if set, only nodes intersecting the key box are kept
+      const OcTreeKey* bbx_max = NULL;
+      const std::bitset<256>* agents = NULL; // if set, only leaves observed by these agents
+      const std::unordered_set<const RoughOcTreeNode*>* nodes = NULL; // if set, only these nodes
+      const std::unordered_set<const RoughOcTreeNode*>* subtrees = NULL; // nodes written with their whole subtree
+    };
+
+    // Binning encoder: appends the records of the node and its subtree (pre-order) to buf.
+    // If split_jobs is given, inner nodes split_depth levels below node are not descended into;
+    // they are listed with the buffer position their subtree's records belong at instead.
+    // depth is that of node in the tree, for binary_max_depth. A filter with a key box needs
+    // node to be the root.
+    void encodeBinaryNodeViaBinning(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int split_depth = 0,
+                                    std::vector<std::pair<size_t, const RoughOcTreeNode*> >* split_jobs = NULL,
+                                    unsigned int depth = 0, const BinaryFilter* filter = NULL) const;
+    // Subtree index of a binning stream: the byte length of every inner subtree at the split depth,
+    // in stream order. Written as a trailer after the tree when binary_subtree_index is set, and
+    // announced by the binary header so that readers only look for it when it is there.
+    struct BinarySubtreeJob {
+      RoughOcTreeNode* node;
+      OcTreeKey key;
+      const char* data;
+      size_t length;
+    };
+    struct BinarySubtreeIndex {
+      unsigned int depth;
+      std::vector<uint64_t> lengths;
+      size_t next = 0;
+      const OcTreeKey* bbx_min = NULL; // if set, subtrees outside the key box are skipped
+      const OcTreeKey* bbx_max = NULL;
+      std::vector<BinarySubtreeJob> jobs; // subtrees below the split, left to decode
+    };
+
+    // Binning decoder: unpacks the records at data into node's subtree. Returns the position
+    // after the subtree, or NULL if the buffer runs out. With an index, only the records above
+    // the split depth are decoded and the subtrees below it are collected in index->jobs.
+    // Decoded nodes are counted in num_nodes, not in tree_size.
+    const char* decodeBinaryNodeViaBinning(const char* data, const char* end, RoughOcTreeNode* node,
+                                           size_t& num_nodes, BinarySubtreeIndex* index = NULL);
+
+    // Like readBinaryData, but only decodes the subtrees of an indexed binning stream that
+    // intersect the box. Streams without an index are decoded completely.
+    std::istream& readBinaryDataBBX(std::istream &s, const point3d& bbx_min, const point3d& bbx_max);
+    // Region of interest: writes a binning stream of only the nodes intersecting the box,
+    // everything else reads as unknown
+    std::ostream& writeBinaryDataBBX(std::ostream &s, const point3d& bbx_min, const point3d& bbx_max);
+    // Writes a binning stream of only the leaves observed by the given agents
+    std::ostream& writeBinaryDataAgents(std::ostream &s, const std::vector<char>& agents);
+    // Merges a binning stream, e.g. a region written by writeBinaryDataBBX, into this tree.
+    // Nodes the stream knows replace ours, unknown ones are kept, and only the subtrees
+    // the stream covers are visited.
+    std::istream& mergeBinaryData(std::istream &s);
+
+    // Change tracking for delta messages, on top of octomap's change detection, which records
+    // the leaves whose occupancy changed. The rough, stair and agent setters record theirs too.
+    inline void enableChangeTracking(bool enable) { this->enableChangeDetection(enable); }
+    // Stamps the changes recorded since the last call with a new version and returns it
+    uint64_t commitChanges();
+    inline uint64_t getChangeVersion() const { return change_version; }
+    void resetChangeTracking();
+    // Drops the keys whose last change is at or before version, e.g. once every peer has
+    // acknowledged it, so the change map stays bounded by the changes still in flight
+    void forgetChangesUpTo(uint64_t version);
+    // Delta message: commits pending changes, then writes a binning stream of only the subtrees
+    // changed after since_version. mergeBinaryData applies it to a copy that is up to date with
+    // since_version. Deleted nodes are not carried over. If changes after since_version were
+    // forgotten or reset, the whole tree is written instead.
+    std::ostream& writeBinaryDelta(std::ostream &s, uint64_t since_version);
+
+    // Merkle hashes for map synchronization: a hash per node over the occupancy, quantized rough
+    // and stair bit that binning transmits, and the agent, combined over the children for inner
+    // nodes. Peers compare them top-down and exchange only the subtrees that differ. With
+    // enableSubtreeHashes, inner node hashes are cached; the update paths record the keys they
+    // touch and the cached hashes along those paths are dropped on the next query.
+    void enableSubtreeHashes(bool enable);
+    // Hash of the node at key and depth, 0 if there is none. Both queries load the map file
+    // subtrees and tiles inside the node first, so the hashes do not depend on what is loaded.
+    uint64_t getSubtreeHash(const OcTreeKey& key, unsigned int depth);
+    // Hashes of its children, 0 for missing ones. Returns false if the node is missing or a leaf.
+    bool getChildHashes(const OcTreeKey& key, unsigned int depth, uint64_t child_hashes[8]);
+    // Leave the agent out of the hashes, for peers that sync over binning messages, which do
+    // not carry it
+    bool subtree_hash_agent = true;
+    // Writes a binning stream of the given subtrees (key and depth of their roots) and the path
+    // down to them. A subtree whose root is inside one of our leaves is sent as that leaf.
+    std::ostream& writeBinaryDataSubtrees(std::ostream &s, const std::vector<std::pair<OcTreeKey, unsigned int> >& subtrees);
+
+    // Occupancy updates, overloaded to materialize the subtree they reach into, record the key for
+    // the subtree hashes and drop the depth counts
+    using OccupancyOcTreeBase<RoughOcTreeNode>::updateNode;
+    virtual RoughOcTreeNode* updateNode(const OcTreeKey& key, float log_odds_update, bool lazy_eval = false);
+    using OccupancyOcTreeBase<RoughOcTreeNode>::setNodeValue;
+    virtual RoughOcTreeNode* setNodeValue(const OcTreeKey& key, float log_odds_value, bool lazy_eval = false);
+    // Every occupancy change of a node goes through here, including integrateHit and integrateMiss
+    // on a node pointer, so it drops the depth counts too. Those calls have no key, so the
+    // caller must record them for the subtree hashes, tiles and journal itself.
+    virtual void updateNodeLogOdds(RoughOcTreeNode* node, const float& update) const;
+    // Variable-width binning: a continuous bit stream with 2 occupancy bits per child, followed
+    // by the rough and stair bits of the occupied leaf children only
+    std::istream& readBinaryNodeViaVariableBinning(std::istream &s, RoughOcTreeNode* node);
+    std::ostream& writeBinaryNodeViaVariableBinning(std::ostream &s, const RoughOcTreeNode* node);
+    // Arithmetic coding: the child codes, rough bins and stair bits of binning, coded with an
+    // adaptive binary range coder. Child codes are modelled on the node depth and the codes of
+    // already coded neighbouring siblings, rough bins on the previous bin, stairs on the previous stair bit.
+    std::istream& readBinaryNodeViaArithmeticCoding(std::istream &s, RoughOcTreeNode* node);
+    std::ostream& writeBinaryNodeViaArithmeticCoding(std::ostream &s, const RoughOcTreeNode* node);
+    // Progressive binning: the binning records of all inner nodes breadth first, each followed by
+    // a byte flagging its occupied inner children. Inner children also carry their aggregated rough
+    // and stair bits. Any prefix of the stream decodes to the tree cut off where the data stops,
+    // so the stream has to be the last thing read.
+    std::istream& readBinaryNodeViaProgressiveBinning(std::istream &s, RoughOcTreeNode* node);
+    std::ostream& writeBinaryNodeViaProgressiveBinning(std::ostream &s, const RoughOcTreeNode* node);
+
+    // Compact full state: every node with its log-odds quantized to 8 bits over the clamping
+    // range (keeping its side of the occupancy threshold), rough and stair log-odds as half
+    // floats, and the agent. 7 bytes a node against the 13 of .ot data, which drops the agent.
+    // Layout: "RCMP", <version : u8>, <clamping_thres_min : f32>, <clamping_thres_max : f32>,
+    // <number of nodes : u64>, then per node in pre-order <child mask : u8>, <log-odds : u8>,
+    // <rough : f16>, <stair log-odds : f16>, <agent : u8>.
+    std::istream& readCompactData(std::istream &s);
+    std::ostream& writeCompactData(std::ostream &s) const;
+
+    // Map files for fast startup. openMapFile memory-maps the file and decodes only the nodes down
+    // to binary_split_depth; the subtrees below stay in the file as leaves with their occupancy and
+    // stairs until a lookup, update, ray or iterator reaches into them (see search). The octomap
+    // writers (write, writeBinaryConst) see them as leaves, so call materializeAll first;
+    // writeBinaryData does. The subtrees are decoded with the bins and stair bits of the file.
+    // Layout: "RMAP", <version : u8>, <split depth : u8>, <number of subtrees : u32>, then per
+    // subtree in stream order <occupied : u8>, <stair log-odds : f32> as they decode, then the
+    // binning data with header and subtree index at the split depth.
+    bool writeMapFile(const std::string& filename);
+    bool openMapFile(const std::string& filename);
+    // Decodes the file subtree or loads the tile containing the node at key and depth
+    // (0 = full depth), if the node is inside one
+    bool materializeSubtree(const OcTreeKey& key, unsigned int depth = 0);
+    // Decodes every file subtree and loads every tile
+    bool materializeAll();
+    inline size_t numFileSubtrees() const { return file_subtrees.pending.size(); }
+
+    // Tiled storage for maps larger than memory: a directory with one binning file per subtree
+    // at the tile depth ("<key x>_<key y>_<key z>.tile", binary header and records) and an index
+    // of the tiles and the leaves above them. Unloaded tiles stay in the tree as leaves with
+    // their occupancy and stairs, like map file subtrees, and are loaded again when a search or
+    // updateNode reaches into them. Updates mark their tile dirty; only dirty tiles are written.
+    // Index layout: "RTIL", <version : u8>, <tile depth : u8>, <number of tiles : u32>,
+    // <number of leaves above the tiles : u32>, then per tile <key : 3 x u16>, <occupied : u8>,
+    // <stair log-odds : f32>, then per leaf <key : 3 x u16>, <depth : u8>, <log-odds : f32>,
+    // <rough : f32>, <stair log-odds : f32>, <agent : u8>.
+    // Starts keeping this tree in directory (created if missing) and writes all of it
+    bool createTileStore(const std::string& directory, unsigned int tile_depth = 8);
+    // Opens a tile store into an empty tree, with every tile unloaded
+    bool openTileStore(const std::string& directory);
+    // Writes the dirty tiles and the index
+    bool saveTiles();
+    bool loadTile(const OcTreeKey& key);
+    // Writes the tile containing key if it is dirty and drops it from memory
+    bool unloadTile(const OcTreeKey& key);
+    // Loads the tiles within radius of center and unloads all others
+    bool setTileWorkingArea(const point3d& center, double radius);
+    inline size_t numUnloadedTiles() const { return tiles.unloaded.size(); }
+
+    // Write-ahead journal for restarting after a crash. While it is open, every occupancy update
+    // (as its log-odds delta) and every rough, stair and agent setter appends a record to a batch,
+    // which goes to the current journal segment once it reaches journal_batch_size bytes or on
+    // flushJournal; a crash loses at most the unflushed batch. The journal is what gets restored:
+    // setNodeValue, explicit prune() calls and readers are not journaled, so neither recovery nor
+    // compaction see them. Files: "<base>.checkpoint" and the segments "<base>.journal.<n>".
+    // Segment layout: "RJNL", <version : u8>, then per batch <length : u32>, <checksum : u32> and
+    // the records <key : 3 x u16>, <fields : u8>, then those of <occupancy delta : f32>,
+    // <stair delta : f32>, <rough : f32>, <stair log-odds : f32>, <agent : u8> the fields flag.
+    // Checkpoint layout: "RCKP", <version : u8>, <last segment folded in : u64>,
+    // <number of leaves : u64>, then the leaves as in the tile index.
+    // Recovers the map kept under base into this tree, which has to be empty then, by replaying
+    // the segments after the checkpoint. With nothing kept yet, this tree is the first checkpoint.
+    bool openJournal(const std::string& base);
+    // Writes the batch to the segment
+    bool flushJournal();
+    // Starts a new segment and folds the finished ones into a new checkpoint, by replaying them
+    // onto the last checkpoint in a scratch tree, in a background thread unless background is
+    // false. The folded segments are removed once the new checkpoint is in place.
+    bool compactJournal(bool background = true);
+    // Waits for a running compaction, false if it failed
+    bool waitForCompaction();
+    // Flushes the batch, waits for the compaction and stops journaling
+    bool closeJournal();
+    inline bool journalOpen() const { return journal.fd >= 0; }
+    size_t journal_batch_size = 1 << 16;
+    bool journal_sync = false; // fdatasync every batch, to survive power loss and not just crashes
+
+    // Leaf for buildFromSortedLeaves, with key and depth as the leaf iterator reports them
+    struct RoughLeaf {
+      OcTreeKey key;
+      unsigned int depth;
+      float log_odds;
+      float rough;
+      float stair_log_odds;
+      char agent;
+    };
+    // The child indices on the path from the root to key, 3 bits a level. Leaves sorted by it are
+    // in depth-first order.
+    uint64_t mortonCode(const OcTreeKey& key) const;
+    // Builds this empty tree bottom-up from leaves sorted by mortonCode in one pass: each node is
+    // created once, on the way down to its first leaf, and finished once the leaves have moved
+    // past it, with its occupancy, rough and stairs set from its children as updateInnerOccupancy
+    // would, and pruned if prune is set. Returns false, and leaves the tree empty, if a leaf is
+    // out of order or overlaps the one before.
+    bool buildFromSortedLeaves(const std::vector<RoughLeaf>& leaves, bool prune = true);
+
+    // Exports the occupied leaves as a binary PLY or PCD point cloud, one point per leaf with
+    // the fields x, y, z (center), size (edge length), rough (NaN if unset), stair (probability)
+    // as f32 and agent as u8. The points are written in one leaf traversal through a fixed-size
+    // buffer, so memory does not grow with the map. With binary_encoding_threads other than 1,
+    // the subtrees at binary_split_depth are written by several threads, in no particular order.
+    // On seekable streams the point count in the header is zero-padded and filled in afterwards;
+    // other streams take a counting pass first. Map file subtrees and tiles are loaded first.
+    std::ostream& writeOccupiedPoints(std::ostream &s, RoughPointFormat format);
+    bool writeOccupiedPoints(const std::string& filename, RoughPointFormat format);
+
+    // Lookups, overloaded to materialize the file subtrees and tiles they reach into. Const
+    // lookups do too: that changes how the map is held, not what it holds, but it does modify
+    // the tree, so they are not safe to call from several threads while subtrees are pending.
+    inline RoughOcTreeNode* search(const OcTreeKey& key, unsigned int depth = 0) const {
+      if (hasFileSubtrees())
+        const_cast<RoughOcTree*>(this)->materializeSubtree(key, depth);
+      return OccupancyOcTreeBase<RoughOcTreeNode>::search(key, depth);
+    }
+    inline RoughOcTreeNode* search(const point3d& value, unsigned int depth = 0) const {
+      OcTreeKey key;
+      if (!this->coordToKeyChecked(value, key)) {
+        OCTOMAP_ERROR_STR("Error in search: ["<< value <<"] is out of OcTree bounds!");
+        return NULL;
+      }
+      return search(key, depth);
+    }
+    inline RoughOcTreeNode* search(double x, double y, double z, unsigned int depth = 0) const {
+      return search(point3d(x, y, z), depth);
+    }
+    // Rays materialize the subtrees they pass through, iterators all of them (the bounding box
+    // ones those intersecting the box), and expand the whole tree before expanding it.
+    // Calls through an OcTreeBaseImpl pointer to its non-virtual members (search, the iterators)
+    // still see pending subtrees as leaves, so call materializeAll before handing the tree over.
+    virtual bool castRay(const point3d& origin, const point3d& direction, point3d& end,
+                         bool ignoreUnknownCells = false, double maxRange = -1.0) const;
+    inline iterator begin(unsigned char maxDepth = 0) const {
+      materializeAllConst();
+      return OccupancyOcTreeBase<RoughOcTreeNode>::begin(maxDepth);
+    }
+    inline leaf_iterator begin_leafs(unsigned char maxDepth = 0) const {
+      materializeAllConst();
+      return OccupancyOcTreeBase<RoughOcTreeNode>::begin_leafs(maxDepth);
+    }
+    inline tree_iterator begin_tree(unsigned char maxDepth = 0) const {
+      materializeAllConst();
+      return OccupancyOcTreeBase<RoughOcTreeNode>::begin_tree(maxDepth);
+    }
+    inline leaf_bbx_iterator begin_leafs_bbx(const OcTreeKey& min, const OcTreeKey& max, unsigned char maxDepth = 0) const {
+      if (hasFileSubtrees())
+        const_cast<RoughOcTree*>(this)->materializeBox(min, max);
+      return OccupancyOcTreeBase<RoughOcTreeNode>::begin_leafs_bbx(min, max, maxDepth);
+    }
+    inline leaf_bbx_iterator begin_leafs_bbx(const point3d& min, const point3d& max, unsigned char maxDepth = 0) const {
+      OcTreeKey min_key, max_key;
+      if (!this->coordToKeyChecked(min, min_key) || !this->coordToKeyChecked(max, max_key)) {
+        OCTOMAP_ERROR_STR("Error in begin_leafs_bbx: bounding box is out of OcTree bounds!");
+        return this->end_leafs_bbx();
+      }
+      return begin_leafs_bbx(min_key, max_key, maxDepth);
+    }
+    virtual void expand();
+
     RoughBinaryEncodingMode binary_encoding_mode;
     float rough_binary_thres; // must be between 0 and 1
 
+    // Parallel binning: subtrees binary_split_depth levels below the root are encoded on
+    // binary_encoding_threads threads (0 = one per core, 1 = serial) and stitched back in order.
+    // Indexed streams are decoded on the same number of threads. A split depth at or below the
+    // tree depth is encoded unsplit, and fails the write if a subtree index is asked for.
+    unsigned int binary_encoding_threads = 1;
+    unsigned int binary_split_depth = 8; // 256 voxels across, a few hundred subtrees for a typical site map
+    // Append the subtree index to binning streams
+    bool binary_subtree_index = false;
+    // Set by the binary readers from the header of the stream being decoded
+    bool binary_index_follows = false;
+    // Inner nodes that header announces, 0 without one. Only used to pre-size decoder buffers.
+    uint64_t binary_inner_nodes_follow = 0;
+    // Deepest level written by the binary encoders (0 = full depth). Inner nodes at this depth
+    // are written as leaves with their own occupancy and stairs, which the updates keep on inner
+    // nodes, and the rough aggregated from the leaves below them while encoding.
+    unsigned int binary_max_depth = 0;
+    inline unsigned int binaryLeafDepth() const {
+      return (binary_max_depth && binary_max_depth < this->tree_depth) ? binary_max_depth : this->tree_depth;
+    }
+
+    // Node counts per depth (0 = root), split by whether the node has children and is occupied
+    struct DepthCounts {
+      uint64_t inner = 0;
+      uint64_t inner_occupied = 0;
+      uint64_t leafs = 0;
+      uint64_t leafs_occupied = 0;
+    };
+    // Kept up to date by the updates, prune, expand, merges and the loading of map file subtrees
+    // and tiles once counted. Recounted in one pass on the first query after a read or bulk build,
+    // an occupancy threshold change, integrateHit or integrateMiss on a node, or a change made
+    // through octomap's non-virtual calls that leaves the tree size off.
+    const std::vector<DepthCounts>& getDepthCounts();
+    // Size in bytes of the binary data writeBinaryData would produce for mode down to max_depth
+    // (0 = full depth) with num_bins rough bins, under the current stair, header and subtree index
+    // settings and before compression. Exact for BINNING and VARIABLE_BINNING, computed from the
+    // depth counts without encoding; 0 for the other modes, whose size depends on the content.
+    uint64_t estimateBinarySize(RoughBinaryEncodingMode mode, unsigned int max_depth, uint num_bins);
+    struct BinaryBudget {
+      unsigned int max_depth;
+      uint num_bins;
+      RoughBinaryEncodingMode mode;
+      uint64_t size;
+      bool fits; // false if nothing fits, in which case the smallest setting is returned
+    };
+    // Settings for a message within budget_bytes: the deepest max depth (from binaryLeafDepth()
+    // up), then the most rough bins (halving from the current count, which is kept while a
+    // quantization table is set), then binning over the smaller but slower variable-width binning
+    BinaryBudget chooseBinaryEncoding(uint64_t budget_bytes);
+
+    // Self-describing header written ahead of the binary data when binaryHeaderEnabled().
+    // readBinaryData detects it and takes the encoding and thresholds from it instead of
+    // the tree's settings. The decoders count the nodes they create, and a count that differs
+    // from the header fails the read; the counts also pre-size the decoders' buffers.
+    // Layout: "RHDR", <version : u8>, <size of the rest : u16>, then the fields below.
+    // Later versions only append fields, so older readers skip what they do not know.
+    struct BinaryHeader {
+      uint version;
+      RoughBinaryEncodingMode mode;
+      uint num_bins;
+      bool stairs;
+      uint stair_bits; // in the bits above the stairs flag, as stair_bits - 1
+      bool subtree_index; // in the bit above those: the binning data ends in a subtree index
+      float rough_binary_thres;
+      float occupancy_thres_log;
+      float clamping_thres_min_log;
+      float clamping_thres_max_log;
+      float stairs_prob_thres_log;
+      uint64_t num_nodes;
+      uint64_t num_leafs;
+      // Since version 2: <table size : u16>, then the edges and values of a non-uniform rough
+      // quantization table (both empty for uniform bins)
+      std::vector<float> rough_bin_edges;
+      std::vector<float> rough_bin_values;
+      // Since version 3, after the table: the stair clamping bounds the stair bins are spread
+      // between (NaN in older headers, which leave the tree's own)
+      float stairs_clamping_thres_min_log;
+      float stairs_clamping_thres_max_log;
+    };
+    static const uint binary_header_version = 3;
+    bool binary_header = false;
+
+    // Reads the header if s starts with one. Otherwise returns false and leaves s where it was.
+    static bool readBinaryHeader(std::istream &s, BinaryHeader& header);
+    std::ostream& writeBinaryHeader(std::ostream &s) const;
+    std::ostream& writeBinaryHeader(std::ostream &s, uint64_t num_nodes, uint64_t num_leafs,
+                                    bool subtree_index = false) const;
+    // Configures the tree for decoding the data following header
+    void applyBinaryHeader(const BinaryHeader& header);
+
     // Binning vars to preallocate and reduce computation per node during read/write
     // These could all be created/destroyed at beginning/end of publishing as well
     uint num_binary_bins; // must be power of 2
     uint num_rough_bits;
-    uint num_bits_per_node; // Controls how much of the bitset is used! (num*8)
+    uint num_bits_per_node; // bits per child, and so bytes per node record (8 children)
     double binsize;
 
-    // Prealloc - All values must correspond!  Using dynamic causes slowdown
     const uint binary_bins_to_use = 16; // must be power of 2; used when roughness is enabled
-    std::bitset<4> rough_bits; // size must equal to log2(binary_bins_to_use)!
-    std::bitset<56> bitmask; // size needs to be same as below!
-    std::bitset<56> read_byte; // size needs to be same as below!
-    std::bitset<56> children; // (log2(num_binary_bins)<rough bits> + 1<stair bit> + 2<occupancy bits>) * 8  - must be set >= binary_bins_to_use and divisible by 8!
+    static const uint max_stair_bits = 4;
+
+    // Non-uniform rough quantization. Without a table, bin b holds rough values from b * binsize
+    // and decodes to b * binsize. With one, bin b holds values below edges[b] and not below
+    // edges[b-1], and decodes to values[b]. The binary header carries the table, so it is
+    // always written while a table is set.
+    // edges: num_binary_bins - 1 ascending values, values: num_binary_bins decoded values
+    bool setRoughQuantization(const std::vector<float>& edges, const std::vector<float>& values);
+    void setUniformRoughQuantization();
+    // Bins evenly spaced in log(rough) between min_rough and 1, below which everything is bin 0
+    bool setLogRoughQuantization(float min_rough = 0.01);
+    // Bins holding equal shares of the rough values of the occupied leafs (at binaryLeafDepth()),
+    // each decoding to the mean of its share. Fails if no occupied leaf has a rough value.
+    bool fitRoughQuantization();
+    inline bool roughQuantizationSet() const { return !rough_bin_values.empty(); }
+    inline const std::vector<float>& getRoughBinEdges() const { return rough_bin_edges; }
+    inline const std::vector<float>& getRoughBinValues() const { return rough_bin_values; }
+    inline bool binaryHeaderEnabled() const {
+      return binary_header || roughQuantizationSet() || binaryStairBits() > 1 || binaryStreamIndexed();
+    }
+    // Whether writeBinaryData appends a subtree index, which the header then announces
+    inline bool binaryStreamIndexed() const {
+      return binary_encoding_mode == BINNING && binary_subtree_index && binary_split_depth > 0 &&
+             binary_split_depth < this->tree_depth;
+    }
+
+    // Bin of a rough value, before masking to num_rough_bits
+    inline uint64_t roughBin(float rough) const {
+      if (rough_bin_values.empty())
+        return (uint64_t)floor(rough / binsize);
+      if (!(rough >= 0))
+        return std::upper_bound(rough_bin_edges.begin(), rough_bin_edges.end(), rough) - rough_bin_edges.begin();
+      // Start from the bin of the bucket's lower end and step over the edges inside the bucket
+      uint64_t b = rough_bin_lut[rough < 1 ? (uint)(rough * rough_bin_lut_size) : rough_bin_lut_size - 1];
+      while (b < rough_bin_edges.size() && rough >= rough_bin_edges[b]) b++;
+      return b;
+    }
+    // Decoded rough value of every bin
+    std::vector<float> roughBinValues() const;
+
+    // Stair field of a node: whether it is stairs on top, and below that which of the
+    // 2^(stair_bits-1) equal steps between stairs_prob_thres_log and the clamping bound on
+    // its side the log-odds fall in
+    inline uint64_t stairBin(const RoughOcTreeNode* node, uint stair_bits) const {
+      const bool stairs = isNodeStairs(node);
+      if (stair_bits == 1) return stairs;
+      const uint steps = 1u << (stair_bits - 1);
+      const float l = node->getStairLogOdds();
+      const float x = stairs ? (l - stairs_prob_thres_log) / (stairs_clamping_thres_max - stairs_prob_thres_log)
+                             : (l - stairs_clamping_thres_min) / (stairs_prob_thres_log - stairs_clamping_thres_min);
+      const float y = x * steps;
+      const uint step = y > 0 ? (y < steps ? (uint)y : steps - 1) : 0;
+      return (stairs ? steps : 0) | step;
+    }
+    // Decoded stair log-odds of every stair field value. Steps decode to their middle, except
+    // the outermost ones, which decode to the clamping bounds that saturated nodes sit at.
+    std::vector<float> stairBinValues(uint stair_bits) const;
+    // Bit counts and decoding tables of data written with header, without applying it to the
+    // tree. Stair clamping bounds missing from older headers are taken from the tree.
+    void binaryHeaderLuts(const BinaryHeader& header, uint& rough_bits, uint& stair_bits,
+                          std::vector<float>& rough_lut, std::vector<float>& stair_lut) const;
+    static const uint max_binary_bins = 256; // largest bin count with a specialized codec
 
   protected:
     bool roughEnabled = false;
     bool stairsEnabled = false;
+    uint num_stair_bits = 1;
+    std::vector<float> rough_bin_edges;
+    std::vector<float> rough_bin_values;
+    // Bin of the lower end of each of the equal buckets [0, 1) is split into, as a starting point
+    // for roughBin instead of searching all the edges
+    static const uint rough_bin_lut_size = 4096;
+    std::vector<uint8_t> rough_bin_lut;
+
+    inline void recordChange(const OcTreeKey& key) {
+      // true, so that octomap does not drop the key when the occupancy flips back
+      if (this->use_change_detection) this->changed_keys[key] = true;
+      markHashDirty(key);
+      markTileDirty(key);
+    }
+    inline void markHashDirty(const OcTreeKey& key) {
+      if (subtree_hashes_enabled) dirty_hash_keys.insert(key);
+    }
+    uint64_t change_version = 0;
+    std::unordered_map<OcTreeKey, uint64_t, OcTreeKey::KeyHash> change_versions; // version of the last change to each key
+    uint64_t forgotten_version = 0; // change_versions no longer holds the changes up to this version
+
+    bool subtree_hashes_enabled = false;
+    // Cached inner node hashes by node key, which is unique across depths for inner nodes
+    std::unordered_map<OcTreeKey, uint64_t, OcTreeKey::KeyHash> subtree_hashes;
+    KeySet dirty_hash_keys; // keys updated since the cache was last brought up to date
+    // Key of the keyed update in progress: its path is in dirty_hash_keys and out of depth_counts
+    const OcTreeKey* update_key = NULL;
+    void dropDirtySubtreeHashes();
+    // Drops every cached hash, after the tree was changed wholesale
+    inline void clearSubtreeHashes() {
+      subtree_hashes.clear();
+      dirty_hash_keys.clear();
+    }
+    uint64_t computeSubtreeHash(const RoughOcTreeNode* node, const OcTreeKey& key, unsigned int depth);
+    uint64_t leafHash(const RoughOcTreeNode* node) const;
+    // Key of the node at depth containing key, as computeChildKey derives it from the root
+    // (adjustKeyAtDepth wraps around at depth 0)
+    inline OcTreeKey hashKey(const OcTreeKey& key, unsigned int depth) const {
+      if (depth == 0) return OcTreeKey(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+      return this->adjustKeyAtDepth(key, depth);
+    }
+    // Node at key and depth, or NULL
+    const RoughOcTreeNode* findNode(const OcTreeKey& key, unsigned int depth) const;
 
     float stairs_clamping_thres_max;
     float stairs_clamping_thres_min;
@@ -531,6 +1041,249 @@ namespace octomap {
 
     void updateInnerOccupancyRecurs(RoughOcTreeNode* node, unsigned int depth);
 
+    // Binning codecs specialized for each (rough bits, stair bits) combination, so the record
+    // width is a compile-time constant. The matching one is picked once per stream.
+    // Subtrees are walked in a loop over an explicit stack rather than by recursion.
+    template <uint RoughBits, uint StairBits>
+    void encodeBinningLoop(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int split_depth,
+                           std::vector<std::pair<size_t, const RoughOcTreeNode*> >* split_jobs,
+                           unsigned int depth, const BinaryFilter* filter) const;
+    // Whether any leaf below node was observed by one of the agents
+    bool subtreeHasAgent(const RoughOcTreeNode* node, const std::bitset<256>& agents) const;
+    // Rough of node as updateInnerOccupancy would aggregate it: its own for a leaf, else the mean
+    // of its children's aggregates. Computed from the leaves, so it is never stale. With a cache,
+    // the aggregate of every inner node below is kept there too.
+    float aggregateRough(const RoughOcTreeNode* node,
+                         std::unordered_map<const RoughOcTreeNode*, float>* cache = NULL) const;
+    // Rough an encoder writes for a child packed as a leaf
+    inline float encodedRough(const RoughOcTreeNode* child) const {
+      return this->nodeHasChildren(child) ? aggregateRough(child) : child->getRough();
+    }
+    std::ostream& writeFilteredBinaryData(std::ostream &s, const BinaryFilter& filter);
+    // decodeBinaryNodeViaBinning with the given bins and stair bits instead of the tree's
+    const char* decodeBinningStream(const char* data, const char* end, RoughOcTreeNode* node, size_t& num_nodes,
+                                    BinarySubtreeIndex* index, uint rough_bits, uint stair_bits,
+                                    const float* rough_lut, const float* stair_lut);
+    template <uint RoughBits, uint StairBits>
+    const char* decodeBinningLoop(const char* data, const char* end, RoughOcTreeNode* node, size_t& num_nodes,
+                                  const float* rough_lut, const float* stair_lut);
+    template <uint RoughBits, uint StairBits>
+    const char* decodeBinningRecurs(const char* data, const char* end, RoughOcTreeNode* node, size_t& num_nodes,
+                                    const float* rough_lut, const float* stair_lut, unsigned int depth, const OcTreeKey& key,
+                                    BinarySubtreeIndex* index);
+    // Packs one node record and returns the mask of inner children. With InnerAttributes,
+    // inner children carry their aggregated rough and stair bits like occupied leaves, the rough
+    // taken from inner_rough when given (see aggregateRough).
+    // With leaf_children, children with children of their own are packed as leaves.
+    // Children not in child_mask, and leaves observed by agents not in agents, are packed as unknown.
+    template <uint RoughBits, uint StairBits, bool InnerAttributes>
+    unsigned int encodeBinningRecord(char* out, const RoughOcTreeNode* node, bool leaf_children,
+                                     unsigned int child_mask, const std::bitset<256>* agents,
+                                     const std::unordered_map<const RoughOcTreeNode*, float>* inner_rough = NULL) const;
+    // Unpacks one node record, creating the children and listing the inner ones
+    template <uint RoughBits, uint StairBits, bool InnerAttributes>
+    void decodeBinningRecord(const char*& data, RoughOcTreeNode* node, size_t& num_nodes, const float* rough_lut,
+                             const float* stair_lut, unsigned char* inner_children, unsigned char& num_inner_children);
+    template <uint RoughBits, uint StairBits>
+    void encodeProgressiveLevels(std::vector<char>& buf, const RoughOcTreeNode* node) const;
+    // Returns NULL if the stream nests inner nodes below the tree depth
+    template <uint RoughBits, uint StairBits>
+    const char* decodeProgressiveLevels(const char* data, const char* end, RoughOcTreeNode* node, size_t& num_nodes,
+                                        const float* rough_lut, const float* stair_lut);
+    template <uint RoughBits, uint StairBits>
+    const char* mergeBinningLoop(const char* data, const char* end, RoughOcTreeNode* node,
+                                 const float* rough_lut, const float* stair_lut);
+    // Deletes all descendants of node, keeping tree_size up to date
+    void deleteNodeChildrenRecurs(RoughOcTreeNode* node);
+    // Thresholding codec, 3 bytes per inner node
+    void encodeThresholdingLoop(std::vector<char>& buf, const RoughOcTreeNode* node) const;
+    const char* decodeThresholdingLoop(const char* data, const char* end, RoughOcTreeNode* node, size_t& num_nodes);
+    // Adaptive contexts of the arithmetic coded stream, see writeBinaryNodeViaArithmeticCoding
+    struct ArithmeticContexts {
+      range_coding::Prob codes[16][4][4][4]; // depth, x-neighbour code, y/z-neighbour code, 2-bit code tree
+      std::vector<range_coding::Prob> rough; // top bits of the previous bin, bin bit tree
+      range_coding::Prob stairs[2];          // previous stair bit
+      uint32_t prev_rough;
+      unsigned int prev_stairs;
+      unsigned int rough_ctx_shift;
+      ArithmeticContexts(unsigned int num_rough_bits);
+    };
+    void encodeArithmeticRecurs(RangeEncoder& rc, ArithmeticContexts& ctx, const RoughOcTreeNode* node,
+                                unsigned int depth) const;
+    bool decodeArithmeticRecurs(RangeDecoder& rc, ArithmeticContexts& ctx, RoughOcTreeNode* node, size_t& num_nodes,
+                                unsigned int depth, const float* rough_lut);
+
+    // Subtrees of a map file still to be decoded, see openMapFile. They are in the tree as
+    // leaves with an empty child array, which keeps them from being pruned.
+    struct FileSubtrees {
+      std::shared_ptr<const char> file; // unmapped with the last subtree
+      unsigned int depth = 0;
+      uint rough_bits = 0;
+      uint stair_bits = 0;
+      std::vector<float> rough_lut;
+      std::vector<float> stair_lut;
+      std::unordered_map<OcTreeKey, std::pair<const char*, size_t>, OcTreeKey::KeyHash> pending; // by subtree key
+    };
+    FileSubtrees file_subtrees;
+    inline bool isFileSubtree(const RoughOcTreeNode* node) const {
+      return node->children != NULL && !this->nodeHasChildren(node);
+    }
+    inline bool hasFileSubtrees() const { return !file_subtrees.pending.empty() || !tiles.unloaded.empty(); }
+    inline void materializeAllConst() const {
+      if (hasFileSubtrees())
+        const_cast<RoughOcTree*>(this)->materializeAll();
+    }
+    // Materializes the pending subtrees intersecting the box between min and max
+    bool materializeBox(const OcTreeKey& min, const OcTreeKey& max);
+    // Materializes the pending subtrees inside the node at key and depth
+    bool materializeNodeBox(const OcTreeKey& key, unsigned int depth);
+    // Materializes the subtrees at depth along a ray, stepping through them in a 3D DDA
+    void materializeRay(const point3d& origin, const point3d& direction, double max_range, unsigned int depth);
+    // Node at depth on the path to key if it is a file subtree or unloaded tile, otherwise NULL
+    RoughOcTreeNode* fileSubtreeNode(const OcTreeKey& key, unsigned int depth);
+
+    // Tile store, see createTileStore
+    struct TileStore {
+      bool active = false;
+      std::string directory;
+      unsigned int depth = 0;
+      KeySet unloaded; // tiles in the tree as leaves, like file subtrees
+      KeySet dirty;    // loaded tiles changed since they were written
+      KeySet stored;   // tiles in the index
+    };
+    TileStore tiles;
+    inline void markTileDirty(const OcTreeKey& key) {
+      if (tiles.active) tiles.dirty.insert(hashKey(key, tiles.depth));
+    }
+    struct TileNode {
+      OcTreeKey key;
+      unsigned int depth;
+      RoughOcTreeNode* node;
+    };
+    // Lists the tiles (inner or unloaded nodes at the tile depth) and the leaves above them
+    void collectTilesRecurs(RoughOcTreeNode* node, unsigned int depth, const OcTreeKey& key,
+                            std::vector<TileNode>& tile_nodes, std::vector<TileNode>& leaves);
+    std::string tileFileName(const OcTreeKey& key) const;
+    bool writeTile(const OcTreeKey& key, const RoughOcTreeNode* node);
+    // Node at depth on the path to key, creating the missing ones
+    RoughOcTreeNode* createNodePath(const OcTreeKey& key, unsigned int depth);
+
+    // Journal, see openJournal
+    struct Journal {
+      int fd = -1;
+      std::string base;
+      uint64_t segment = 0;
+      std::vector<char> batch;
+      std::future<bool> compaction;
+      Journal() {}
+      // A copy of the tree does not write to the journal
+      Journal(const Journal&) {}
+    };
+    Journal journal;
+    enum JournalFields {
+      JOURNAL_OCCUPANCY = 1,
+      JOURNAL_STAIR_UPDATE = 2,
+      JOURNAL_ROUGH = 4,
+      JOURNAL_STAIRS = 8,
+      JOURNAL_AGENT = 16
+    };
+    // Appends a record with the given fields, delta being the occupancy or stair delta and the
+    // rest taken from node
+    inline void journalUpdate(const OcTreeKey& key, unsigned int fields, float delta, const RoughOcTreeNode* node) {
+      if (journal.fd >= 0) appendJournalRecord(key, fields, delta, node);
+    }
+    void appendJournalRecord(const OcTreeKey& key, unsigned int fields, float delta, const RoughOcTreeNode* node);
+    bool openJournalSegment(uint64_t segment);
+    bool replayJournalSegment(const std::string& name);
+    // Bulk build, see buildFromSortedLeaves
+    struct BulkBuild {
+      std::vector<RoughOcTreeNode*> path; // from the root to the last leaf
+      unsigned int depth = 0;             // of the last leaf
+      uint64_t last = 0;                  // Morton code at the end of the last leaf
+      bool started = false;
+      bool prune = true;
+    };
+    // Creates the path to a leaf and returns the leaf for the caller to fill in, NULL if it is
+    // out of order. The nodes the previous leaf does not share with it are finished first.
+    RoughOcTreeNode* addBulkLeaf(BulkBuild& build, const OcTreeKey& key, unsigned int depth);
+    // Finishes the nodes on the path from the last leaf up to depth
+    void finishBulkNodes(BulkBuild& build, unsigned int depth);
+
+    // Point export, see writeOccupiedPoints. Full buffers go to the stream, under the lock
+    // when several threads write.
+    struct PointBuffer {
+      std::ostream* s;
+      std::mutex* lock;
+      std::vector<char> data;
+      uint64_t count; // points written to data so far
+      void flush();
+    };
+    // Writes the occupied leaves below node, collecting the nodes at split_depth in subtrees
+    // instead of descending into them if it is set
+    void writePointsRecurs(PointBuffer& out, const RoughOcTreeNode* node, unsigned int depth, const OcTreeKey& key,
+                           std::vector<std::pair<OcTreeKey, const RoughOcTreeNode*> >* subtrees, unsigned int split_depth) const;
+
+    // Loads the checkpoint under base into this empty tree; segment is the last one it contains
+    bool readJournalCheckpoint(const std::string& base, uint64_t& segment);
+    // Replaces the checkpoint under base with this tree and removes the segments up to segment
+    bool writeJournalCheckpoint(const std::string& base, uint64_t segment) const;
+    // Checkpoint records of the leaves below node, in depth-first order
+    void appendLeafRecordsRecurs(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int depth,
+                                 const OcTreeKey& key) const;
+    // Occupancy and stairs the subtree of node decodes to from a binning stream
+    void fileSubtreeSummaryRecurs(const RoughOcTreeNode* node, const float* stair_lut, bool& occupied, float& stair) const;
+
+    // Counts the nodes and leafs written down to binaryLeafDepth()
+    void countNodesRecurs(const RoughOcTreeNode* node, unsigned int depth, size_t& num_nodes, size_t& num_leafs) const;
+
+    std::vector<DepthCounts> depth_counts;
+    mutable bool depth_counts_valid = false; // also dropped by the const updateNodeLogOdds
+    float depth_counts_occ_thres = 0; // occupancy threshold they were counted at
+    inline void invalidateDepthCounts() const { depth_counts_valid = false; }
+    // Adjust valid depth counts by sign (1 or -1) for the node alone, its subtree, or the nodes
+    // on the path to key
+    void countDepthNode(const RoughOcTreeNode* node, unsigned int depth, int sign);
+    void countDepthSubtreeRecurs(const RoughOcTreeNode* node, unsigned int depth, int sign);
+    void countDepthPath(const OcTreeKey& key, int sign);
+    // For the children of a node on the path to update_key, except the one on the path
+    void countDepthOffPath(const RoughOcTreeNode* node, int sign);
+    // Keyed updates take the path out of the depth counts before changing it, and put it back after
+    inline void beginKeyedUpdate(const OcTreeKey& key) {
+      update_key = &key;
+      countDepthPath(key, -1);
+    }
+    inline void endKeyedUpdate() {
+      countDepthPath(*update_key, 1);
+      update_key = NULL;
+    }
+    // pruneNode without the cache upkeep
+    void collapseNode(RoughOcTreeNode* node);
+    void pruneCountedRecurs(RoughOcTreeNode* node, unsigned int depth, unsigned int max_depth, unsigned int& num_pruned);
+    void expandCountedRecurs(RoughOcTreeNode* node, unsigned int depth);
+
+    // Sets inner nodes above the split depth from their children once the subtrees are decoded
+    void updateInnerBinningRecurs(RoughOcTreeNode* node, unsigned int depth, unsigned int split_depth);
+
+    // Creates a child and counts it in num_nodes instead of tree_size, so subtrees can be decoded
+    // concurrently, each into its own count
+    inline RoughOcTreeNode* allocNodeChild(RoughOcTreeNode* node, unsigned int childIdx, size_t& num_nodes) {
+      if (node->children == NULL) this->allocNodeChildren(node);
+      RoughOcTreeNode* child = new RoughOcTreeNode();
+      node->children[childIdx] = child;
+      num_nodes++;
+      return child;
+    }
+    // Deletes a childless child again, taking it off num_nodes
+    inline void freeNodeChild(RoughOcTreeNode* node, unsigned int childIdx, size_t& num_nodes) {
+      this->deleteNodeRecurs(this->getNodeChild(node, childIdx));
+      node->children[childIdx] = NULL;
+      num_nodes--;
+    }
+    template <uint RoughBits, bool Stairs>
+    void encodeVariableRecurs(BitWriter& w, const RoughOcTreeNode* node, unsigned int depth) const;
+    template <uint RoughBits, bool Stairs>
+    bool decodeVariableRecurs(BitReader& r, RoughOcTreeNode* node, const float* rough_lut, unsigned int depth);
+
     /**
      * Static member object which ensures that this OcTree's prototype
      * ends up in the classIDMapping only once. You need this as a
@@ -42,6 +42,7 @@
 #include <octomap_msgs/Octomap.h>
 #include <octomap/ColorOcTree.h>
 #include <rough_octomap/RoughOcTree.h>
+#include <rough_octomap/Compression.h>
 
 // new conversion functions
 namespace octomap_msgs{
@@ -54,6 +55,18 @@ namespace octomap_msgs{
    * to it. You will need to free the memory when you're done.
    */
   static inline octomap::AbstractOcTree* fullMsgToMap(const Octomap& msg){
+    // Compact full state of a RoughOcTree, see compactMapToMsg
+    if (msg.id == "RoughOcTree-C"){
+      octomap::RoughOcTree* octree = new octomap::RoughOcTree(msg.resolution);
+      std::stringstream datastream;
+      datastream.write((const char*) msg.data.data(), msg.data.size());
+      if (!octree->readCompactData(datastream)){
+        delete octree;
+        return NULL;
+      }
+      return octree;
+    }
+
     octomap::AbstractOcTree* tree = octomap::AbstractOcTree::createTree(msg.id, msg.resolution);
     if (tree){
       std::stringstream datastream;
@@ -75,21 +88,32 @@ namespace octomap_msgs{
   }
 
 
+  // Returns false if the data was corrupt, truncated or could not be decompressed
   template<class TreeType>
-  void readTree(TreeType* octree, const Octomap& msg){
+  bool readTree(TreeType* octree, const Octomap& msg,
+                octomap::RoughCompressionMode compression = octomap::NO_COMPRESSION){
     // printf("readtree msgsize %d\n",msg.data.size());
+    if (msg.data.size() > 0 && compression != octomap::NO_COMPRESSION){
+      // Decompress chunk by chunk as the decoder reads
+      octomap::DecompressingBuffer buffer((const char*) &msg.data[0], msg.data.size(), compression);
+      std::istream datastream(&buffer);
+      octree->readBinaryData(datastream);
+      return !buffer.failed() && !datastream.fail();
+    }
     std::stringstream datastream;
     if (msg.data.size() > 0){
       datastream.write((const char*) &msg.data[0], msg.data.size());
       octree->readBinaryData(datastream);
     }
+    return !datastream.fail();
   }
 
 
   /**
    * @brief Creates a new octree by deserializing from msg,
    * e.g. from a message or service (binary: only free and occupied .bt file format).
-   * This creates a new OcTree object and returns a pointer to it.
+   * This creates a new OcTree object and returns a pointer to it, or NULL if the
+   * data is corrupt, truncated or cannot be decompressed.
    * You will need to free the memory when you're done.
    */
    static inline octomap::AbstractOcTree* binaryMsgToMap(const Octomap& msg){
@@ -97,33 +121,62 @@ namespace octomap_msgs{
      if (!msg.binary)
        return NULL;
 
+     // A compression stage is signalled by the last id suffix
+     std::string id = msg.id;
+     octomap::RoughCompressionMode compression = octomap::stripCompressionSuffix(id);
+     if (!octomap::compressionAvailable(compression)) {
+       ROS_ERROR("Map message %s is compressed with an unsupported method.", msg.id.c_str());
+       return NULL;
+     }
+
      // Check if this a stairs map first, then if not, just regular RoughOctree
      bool stairs = true;
      int bin_pos = 14;
-     int str_pos = msg.id.find("RoughOcTree-S-");
+     int str_pos = id.find("RoughOcTree-S-");
      if (str_pos == std::string::npos) {
-       str_pos = msg.id.find("RoughOcTree-");
+       str_pos = id.find("RoughOcTree-");
        bin_pos = 12;
        stairs = false;
      }
      octomap::AbstractOcTree* tree;
-     if (msg.id == "ColorOcTree"){
+     bool ok;
+     if (str_pos != std::string::npos && id.size() > 2 && id.compare(id.size() - 2, 2, "-H") == 0){
+       // Configured by the binary header
+       octomap::RoughOcTree* octree = new octomap::RoughOcTree(msg.resolution);
+       ok = readTree(octree, msg, compression);
+       tree = octree;
+     }
+     else if (id == "ColorOcTree"){
        octomap::ColorOcTree* octree = new octomap::ColorOcTree(msg.resolution);
-       readTree(octree, msg);
+       ok = readTree(octree, msg, compression);
        tree = octree;
      }
      else if (str_pos != std::string::npos){
        octomap::RoughOcTree* octree = new octomap::RoughOcTree(msg.resolution);
        octree->setStairsEnabled(stairs);
        // Set the number of bins, embedded in the id
-       octree->setNumBins(stoi(msg.id.substr(bin_pos)));
-       readTree(octree, msg);
+       octree->setNumBins(stoi(id.substr(bin_pos)));
+       // Variable-width binning is flagged by a trailing "-V"
+       if (id.find("-V", bin_pos) != std::string::npos)
+         octree->binary_encoding_mode = octomap::VARIABLE_BINNING;
+       // and arithmetic coding by "-A"
+       else if (id.find("-A", bin_pos) != std::string::npos)
+         octree->binary_encoding_mode = octomap::ARITHMETIC_CODING;
+       // and progressive binning by "-P"
+       else if (id.find("-P", bin_pos) != std::string::npos)
+         octree->binary_encoding_mode = octomap::PROGRESSIVE_BINNING;
+       ok = readTree(octree, msg, compression);
        tree = octree;
      } else {
        octomap::OcTree* octree = new octomap::OcTree(msg.resolution);
-       readTree(octree, msg);
+       ok = readTree(octree, msg, compression);
        tree = octree;
      }
+     if (!ok) {
+       ROS_ERROR("Map message %s could not be decoded.", msg.id.c_str());
+       delete tree;
+       return NULL;
+     }
      return tree;
    }
 
@@ -203,7 +256,13 @@ namespace octomap_msgs{
     Suffix(T* t) {
       std::string stairsPrefix;
       if (t->getStairsEnabled()) stairsPrefix = "-S";
-      return stairsPrefix + "-" + std::to_string(t->getNumBins());
+      std::string modeSuffix;
+      if (t->binary_encoding_mode == octomap::VARIABLE_BINNING) modeSuffix = "-V";
+      else if (t->binary_encoding_mode == octomap::ARITHMETIC_CODING) modeSuffix = "-A";
+      else if (t->binary_encoding_mode == octomap::PROGRESSIVE_BINNING) modeSuffix = "-P";
+      // The data carries its own header, the rest of the id is only informative
+      if (t->binaryHeaderEnabled()) modeSuffix += "-H";
+      return stairsPrefix + "-" + std::to_string(t->getNumBins()) + modeSuffix;
     }
 
   std::string Suffix(...) { return ""; }
@@ -216,11 +275,25 @@ namespace octomap_msgs{
    * @return success of serialization
    */
   template <class OctomapT>
-  static inline bool binaryMapToMsg(OctomapT& octomap, Octomap& msg){
+  static inline bool binaryMapToMsg(OctomapT& octomap, Octomap& msg,
+                                    octomap::RoughCompressionMode compression = octomap::NO_COMPRESSION,
+                                    int compression_level = 3){
     msg.resolution = octomap.getResolution();
-    msg.id = octomap.getTreeType() + Suffix(&octomap);
+    msg.id = octomap.getTreeType() + Suffix(&octomap) + octomap::compressionSuffix(compression);
     msg.binary = true;
 
+    if (compression != octomap::NO_COMPRESSION) {
+      // Compress the encoder output as it is written, straight into the message
+      msg.data.clear();
+      octomap::CompressingBuffer buffer(msg.data, compression, compression_level);
+      std::ostream datastream(&buffer);
+      if (!octomap.writeBinaryData(datastream) || !datastream.flush() || !buffer.finish()) {
+        ROS_ERROR("writeBinaryData failed.");
+        return false;
+      }
+      return true;
+    }
+
     std::stringstream datastream;
     // ROS_INFO("Writing binary data.");
     if (!octomap.writeBinaryData(datastream)) {
@@ -233,6 +306,50 @@ namespace octomap_msgs{
     return true;
   }
 
+  /**
+   * @brief Serialization of a RoughOcTree down to max_depth only (0 = full depth), e.g. for
+   * low bandwidth links. Inner nodes at max_depth are sent as leaves with their aggregated
+   * occupancy, rough and stairs, straight from the full tree without copying or pruning it.
+   * @return success of serialization
+   */
+  static inline bool binaryMapToMsg(octomap::RoughOcTree& octomap, Octomap& msg, unsigned int max_depth,
+                                    octomap::RoughCompressionMode compression = octomap::NO_COMPRESSION,
+                                    int compression_level = 3){
+    const unsigned int full_max_depth = octomap.binary_max_depth;
+    octomap.binary_max_depth = max_depth;
+    const bool ok = binaryMapToMsg<octomap::RoughOcTree>(octomap, msg, compression, compression_level);
+    octomap.binary_max_depth = full_max_depth;
+    return ok;
+  }
+
+  /**
+   * @brief Serialization of a RoughOcTree within budget_bytes, e.g. for a rate-limited link.
+   * Max depth, bin count and encoding are picked by RoughOcTree::chooseBinaryEncoding from the
+   * node counts the tree keeps per depth, without trial encodes. The budget applies to the
+   * uncompressed data, so compression only takes the message further below it. If nothing
+   * fits, the smallest setting is sent.
+   * @return success of serialization
+   */
+  static inline bool binaryMapToMsgWithinBudget(octomap::RoughOcTree& octomap, Octomap& msg, uint64_t budget_bytes,
+                                                octomap::RoughCompressionMode compression = octomap::NO_COMPRESSION,
+                                                int compression_level = 3){
+    const octomap::RoughOcTree::BinaryBudget choice = octomap.chooseBinaryEncoding(budget_bytes);
+    if (!choice.fits)
+      ROS_WARN("No binary encoding fits %lu bytes, sending %lu.", (unsigned long)budget_bytes, (unsigned long)choice.size);
+
+    const unsigned int full_max_depth = octomap.binary_max_depth;
+    const uint full_bins = octomap.getNumBins();
+    const octomap::RoughBinaryEncodingMode full_mode = octomap.binary_encoding_mode;
+    octomap.binary_max_depth = choice.max_depth;
+    if (choice.num_bins != full_bins) octomap.setNumBins(choice.num_bins);
+    octomap.binary_encoding_mode = choice.mode;
+    const bool ok = binaryMapToMsg<octomap::RoughOcTree>(octomap, msg, compression, compression_level);
+    octomap.binary_max_depth = full_max_depth;
+    if (choice.num_bins != full_bins) octomap.setNumBins(full_bins);
+    octomap.binary_encoding_mode = full_mode;
+    return ok;
+  }
+
   /**
    * @brief Serialization of an octree into binary data e.g. for messages and services.
    * Full probability version (stores complete state of tree, .ot file format).
@@ -255,6 +372,25 @@ namespace octomap_msgs{
     return true;
   }
 
+  /**
+   * @brief Serialization of the complete state of a RoughOcTree, agent included, in the
+   * compact format of RoughOcTree::writeCompactData (about half the size of fullMapToMsg).
+   * @return success of serialization
+   */
+  static inline bool compactMapToMsg(const octomap::RoughOcTree& octomap, Octomap& msg){
+    msg.resolution = octomap.getResolution();
+    msg.id = octomap.getTreeType() + "-C";
+    msg.binary = false;
+
+    std::stringstream datastream;
+    if (!octomap.writeCompactData(datastream))
+      return false;
+
+    std::string datastring = datastream.str();
+    msg.data = std::vector<int8_t>(datastring.begin(), datastring.end());
+    return true;
+  }
+
 }
 
 
@@ -0,0 +1,195 @@
+#include <rough_octomap/Compression.h>
+
+#include <octomap/octomap_types.h>
+
+#include <cstring>
+
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace octomap {
+
+  namespace {
+    // Writes smaller than this are gathered before being handed to the compressor
+    const size_t pending_size = 1 << 16;
+  }
+
+  bool compressionAvailable(RoughCompressionMode mode) {
+    switch (mode) {
+      case NO_COMPRESSION:
+        return true;
+      case ZSTD_COMPRESSION:
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+  }
+
+  std::string compressionSuffix(RoughCompressionMode mode) {
+    if (mode == ZSTD_COMPRESSION) return "-Z";
+    return "";
+  }
+
+  RoughCompressionMode stripCompressionSuffix(std::string& id) {
+    if (id.size() > 2 && id.compare(id.size() - 2, 2, "-Z") == 0) {
+      id.erase(id.size() - 2);
+      return ZSTD_COMPRESSION;
+    }
+    return NO_COMPRESSION;
+  }
+
+
+  CompressingBuffer::CompressingBuffer(std::vector<int8_t>& out, RoughCompressionMode mode, int level)
+    : out(out), ctx(NULL), failed(false), finished(false) {
+    pending.resize(pending_size);
+    setp(&pending[0], &pending[0] + pending.size());
+    if (!compressionAvailable(mode) || mode == NO_COMPRESSION) {
+      OCTOMAP_ERROR("Compression mode %d is not available.\n", (int)mode);
+      failed = true;
+      return;
+    }
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (cctx == NULL || ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))) {
+      OCTOMAP_ERROR("Could not set up the zstd compressor.\n");
+      failed = true;
+    }
+    ctx = cctx;
+#else
+    (void)level;
+#endif
+  }
+
+  CompressingBuffer::~CompressingBuffer() {
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx*)ctx);
+#endif
+  }
+
+  bool CompressingBuffer::compress(const char* data, size_t size, bool end) {
+    if (failed) return false;
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    const size_t out_chunk = ZSTD_CStreamOutSize();
+    ZSTD_inBuffer input = { data, size, 0 };
+    const ZSTD_EndDirective directive = end ? ZSTD_e_end : ZSTD_e_continue;
+    for (;;) {
+      // Compress straight into the tail of out, trimming whatever the step did not use
+      const size_t start = out.size();
+      out.resize(start + out_chunk);
+      ZSTD_outBuffer output = { &out[start], out_chunk, 0 };
+      const size_t remaining = ZSTD_compressStream2((ZSTD_CCtx*)ctx, &output, &input, directive);
+      out.resize(start + output.pos);
+      if (ZSTD_isError(remaining)) {
+        OCTOMAP_ERROR("zstd compression failed: %s\n", ZSTD_getErrorName(remaining));
+        failed = true;
+        return false;
+      }
+      if (end ? remaining == 0 : input.pos == input.size) break;
+    }
+    return true;
+#else
+    (void)data; (void)size; (void)end;
+    return false;
+#endif
+  }
+
+  bool CompressingBuffer::flushPending() {
+    const size_t n = pptr() - pbase();
+    setp(&pending[0], &pending[0] + pending.size());
+    return n == 0 || compress(&pending[0], n, false);
+  }
+
+  CompressingBuffer::int_type CompressingBuffer::overflow(int_type c) {
+    if (finished || !flushPending()) return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize CompressingBuffer::xsputn(const char* s, std::streamsize n) {
+    if (finished) return 0;
+    // Large writes (whole encoder buffers) bypass the pending area
+    if ((size_t)n >= pending.size()) {
+      if (!flushPending() || !compress(s, n, false)) return 0;
+      return n;
+    }
+    return std::streambuf::xsputn(s, n);
+  }
+
+  int CompressingBuffer::sync() {
+    return (finished || flushPending()) ? 0 : -1;
+  }
+
+  bool CompressingBuffer::finish() {
+    if (finished) return !failed;
+    const size_t n = pptr() - pbase();
+    setp(&pending[0], &pending[0] + pending.size());
+    compress(&pending[0], n, true);
+    finished = true;
+    return !failed;
+  }
+
+
+  DecompressingBuffer::DecompressingBuffer(const char* data, size_t size, RoughCompressionMode mode)
+    : data(data), size(size), pos(0), ctx(NULL), error(false), frame_done(false) {
+    setg(NULL, NULL, NULL);
+    if (!compressionAvailable(mode) || mode == NO_COMPRESSION) {
+      OCTOMAP_ERROR("Compression mode %d is not available.\n", (int)mode);
+      error = true;
+      return;
+    }
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    chunk.resize(ZSTD_DStreamOutSize());
+    ctx = ZSTD_createDCtx();
+    if (ctx == NULL) {
+      OCTOMAP_ERROR("Could not set up the zstd decompressor.\n");
+      error = true;
+    }
+#endif
+  }
+
+  DecompressingBuffer::~DecompressingBuffer() {
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    ZSTD_freeDCtx((ZSTD_DCtx*)ctx);
+#endif
+  }
+
+  DecompressingBuffer::int_type DecompressingBuffer::underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (error) return traits_type::eof();
+#ifdef ROUGH_OCTOMAP_WITH_ZSTD
+    // A step can produce no output (headers, or output still held back), so keep going until
+    // some appears; once the input is used up, only a frame still being flushed can produce more
+    while (pos < size || !frame_done) {
+      ZSTD_inBuffer input = { data, size, pos };
+      ZSTD_outBuffer output = { &chunk[0], chunk.size(), 0 };
+      const size_t ret = ZSTD_decompressStream((ZSTD_DCtx*)ctx, &output, &input);
+      if (ZSTD_isError(ret)) {
+        OCTOMAP_ERROR("zstd decompression failed: %s\n", ZSTD_getErrorName(ret));
+        error = true;
+        return traits_type::eof();
+      }
+      const bool consumed = input.pos > pos;
+      pos = input.pos;
+      frame_done = (ret == 0);
+      if (output.pos > 0) {
+        setg(&chunk[0], &chunk[0], &chunk[0] + output.pos);
+        return traits_type::to_int_type(*gptr());
+      }
+      if (!consumed && pos == size && !frame_done) {
+        OCTOMAP_ERROR("Compressed map data is truncated.\n");
+        error = true;
+        return traits_type::eof();
+      }
+    }
+#endif
+    return traits_type::eof();
+  }
+
+}
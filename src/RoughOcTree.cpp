@@ -33,8 +33,363 @@
 
 #include <rough_octomap/RoughOcTree.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace octomap {
 
+  namespace {
+    // Pre-sizing from the counts of a binary header stops here, they are unchecked input
+    const size_t max_reserve_bytes = 64 << 20;
+
+    // Binary data runs to the end of the stream (messages and .bt files), so the buffered
+    // decoders pull the rest of it into one contiguous buffer. expected_bytes pre-sizes it when
+    // the stream cannot tell its length.
+    void readRemaining(std::istream &s, std::vector<char>& buf, uint64_t expected_bytes = 0) {
+      const std::streampos start = s.tellg();
+      if (start != std::streampos(-1)) {
+        s.seekg(0, std::ios_base::end);
+        const std::streamoff len = s.tellg() - start;
+        s.seekg(start);
+        buf.resize(len);
+        s.read(buf.data(), len);
+      }
+      else {
+        buf.clear();
+        buf.reserve(std::min<uint64_t>(expected_bytes, max_reserve_bytes));
+        buf.insert(buf.end(), std::istreambuf_iterator<char>(s), std::istreambuf_iterator<char>());
+      }
+    }
+
+    // Hand back the bytes the decoder did not consume
+    void unreadRemaining(std::istream &s, std::streamoff unread) {
+      if (unread > 0) {
+        s.clear();
+        s.seekg(-unread, std::ios_base::cur);
+      }
+    }
+
+    // Subtree index trailer: <length : u64> * count, <count : u32>, <split depth : u8>, "RIDX"
+    const char subtree_index_magic[4] = {'R', 'I', 'D', 'X'};
+    const size_t subtree_index_footer = 4 + 1 + sizeof(subtree_index_magic);
+
+    void putLittleEndian(std::ostream &s, uint64_t v, uint num_bytes) {
+      char bytes[8];
+      for (uint i=0; i<num_bytes; i++) bytes[i] = (char)(v >> (8 * i));
+      s.write(bytes, num_bytes);
+    }
+
+    uint64_t getLittleEndian(const char* data, uint num_bytes) {
+      uint64_t v = 0;
+      for (uint i=0; i<num_bytes; i++) v |= (uint64_t)(unsigned char)data[i] << (8 * i);
+      return v;
+    }
+
+    void writeSubtreeIndex(std::ostream &s, unsigned int depth, const std::vector<std::vector<char> >& subtrees) {
+      for (size_t j=0; j<subtrees.size(); j++) {
+        putLittleEndian(s, subtrees[j].size(), 8);
+      }
+      putLittleEndian(s, subtrees.size(), 4);
+      putLittleEndian(s, depth, 1);
+      s.write(subtree_index_magic, sizeof(subtree_index_magic));
+    }
+
+    // If the data ends in a subtree index, reads it and moves end to where the tree ends
+    bool readSubtreeIndex(const char* data, const char*& end, unsigned int& depth, std::vector<uint64_t>& lengths) {
+      const size_t size = end - data;
+      if (size < subtree_index_footer || memcmp(end - sizeof(subtree_index_magic), subtree_index_magic, sizeof(subtree_index_magic)))
+        return false;
+      const char* footer = end - subtree_index_footer;
+      const uint64_t count = getLittleEndian(footer, 4);
+      depth = getLittleEndian(footer + 4, 1);
+      if (depth == 0 || count > (size - subtree_index_footer) / 8)
+        return false;
+
+      const char* entries = footer - count * 8;
+      lengths.resize(count);
+      uint64_t total = 0;
+      for (size_t j=0; j<count; j++) {
+        lengths[j] = getLittleEndian(entries + 8 * j, 8);
+        total += lengths[j];
+      }
+      if (total > (uint64_t)(entries - data))
+        return false;
+
+      end = entries;
+      return true;
+    }
+
+    // Binary header, see RoughOcTree::BinaryHeader
+    const char binary_header_magic[4] = {'R', 'H', 'D', 'R'};
+    const size_t binary_header_fields_v1 = 40;
+    const size_t binary_header_fields_v2 = 42; // without the table
+    const size_t binary_header_fields_v3 = 50; // without the table, which comes before the last two fields
+
+    void putFloat(std::ostream &s, float v) {
+      uint32_t bits;
+      memcpy(&bits, &v, sizeof(bits));
+      putLittleEndian(s, bits, 4);
+    }
+
+    float getFloat(const char* data) {
+      const uint32_t bits = getLittleEndian(data, 4);
+      float v;
+      memcpy(&v, &bits, sizeof(v));
+      return v;
+    }
+
+    // Compact full state, see RoughOcTree::writeCompactData
+    const char compact_magic[4] = {'R', 'C', 'M', 'P'};
+    const unsigned int compact_version = 1;
+    const size_t compact_header_size = sizeof(compact_magic) + 1 + 4 + 4 + 8;
+    const size_t compact_node_size = 7;
+
+    // Map files, see RoughOcTree::openMapFile
+    const char map_file_magic[4] = {'R', 'M', 'A', 'P'};
+    const unsigned int map_file_version = 1;
+    const size_t map_file_prefix = sizeof(map_file_magic) + 1 + 1 + 4;
+    const size_t map_file_summary_size = 5;
+
+    // Tile store index, see RoughOcTree::createTileStore
+    const char tile_index_magic[4] = {'R', 'T', 'I', 'L'};
+    const unsigned int tile_index_version = 1;
+    const size_t tile_index_prefix = sizeof(tile_index_magic) + 1 + 1 + 4 + 4;
+    const size_t tile_index_tile_size = 6 + 1 + 4;
+
+    // Full-precision leaf of the tile index and journal checkpoints: <key : 3 x u16>, <depth : u8>,
+    // <log-odds : f32>, <rough : f32>, <stair log-odds : f32>, <agent : u8>
+    const size_t leaf_record_size = 6 + 1 + 4 + 4 + 4 + 1;
+
+    inline OcTreeKey getRecordKey(const char* data) {
+      return OcTreeKey(getLittleEndian(data, 2), getLittleEndian(data + 2, 2), getLittleEndian(data + 4, 2));
+    }
+
+    void getLeafRecord(const char* data, RoughOcTreeNode* node) {
+      node->setLogOdds(getFloat(data + 7));
+      node->setRough(getFloat(data + 11));
+      node->setStairLogOdds(getFloat(data + 15));
+      node->setAgent(data[19]);
+    }
+
+    // Update journal, see RoughOcTree::openJournal
+    const char journal_magic[4] = {'R', 'J', 'N', 'L'};
+    const char checkpoint_magic[4] = {'R', 'C', 'K', 'P'};
+    const unsigned int journal_version = 1;
+    const size_t journal_prefix = sizeof(journal_magic) + 1;
+    const size_t journal_batch_prefix = 4 + 4;
+    const size_t checkpoint_prefix = sizeof(checkpoint_magic) + 1 + 8 + 8;
+
+    inline void appendLittleEndian(std::vector<char>& buf, uint64_t v, uint num_bytes) {
+      for (uint i=0; i<num_bytes; i++) buf.push_back((char)(v >> (8 * i)));
+    }
+
+    inline void appendFloat(std::vector<char>& buf, float v) {
+      uint32_t bits;
+      memcpy(&bits, &v, sizeof(bits));
+      appendLittleEndian(buf, bits, 4);
+    }
+
+    inline void appendLeafRecord(std::vector<char>& buf, const OcTreeKey& key, unsigned int depth, const RoughOcTreeNode* node) {
+      for (unsigned int a=0; a<3; a++) appendLittleEndian(buf, key[a], 2);
+      buf.push_back((char)depth);
+      appendFloat(buf, node->getLogOdds());
+      appendFloat(buf, node->getRough());
+      appendFloat(buf, node->getStairLogOdds());
+      buf.push_back(node->getAgent());
+    }
+
+    // FNV-1a over a batch, to find the one a crash cut off
+    uint32_t journalChecksum(const char* data, size_t size) {
+      uint32_t h = 2166136261u;
+      for (size_t i=0; i<size; i++) h = (h ^ (unsigned char)data[i]) * 16777619u;
+      return h;
+    }
+
+    bool writeAll(int fd, const char* data, size_t size) {
+      while (size > 0) {
+        const ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+      }
+      return true;
+    }
+
+    std::string journalSegmentName(const std::string& base, uint64_t segment) {
+      std::ostringstream name;
+      name << base << ".journal." << segment;
+      return name.str();
+    }
+
+    // Point export, see RoughOcTree::writeOccupiedPoints
+    const size_t point_record_size = 6 * 4 + 1;
+    const size_t point_buffer_size = 1 << 16;
+
+    inline void storeFloat(char* data, float v) {
+      uint32_t bits;
+      memcpy(&bits, &v, sizeof(bits));
+      for (uint i=0; i<4; i++) data[i] = (char)(bits >> (8 * i));
+    }
+
+    std::string pointCloudHeader(RoughPointFormat format, uint64_t num_points, bool padded) {
+      std::ostringstream count;
+      if (padded) count << std::setw(10) << std::setfill('0');
+      count << num_points;
+      std::ostringstream h;
+      if (format == PLY_POINTS) {
+        h << "ply\n"
+          << "format binary_little_endian 1.0\n"
+          << "element vertex " << count.str() << "\n"
+          << "property float x\nproperty float y\nproperty float z\nproperty float size\n"
+          << "property float rough\nproperty float stair\nproperty uchar agent\n"
+          << "end_header\n";
+      }
+      else {
+        h << "# .PCD v0.7 - Point Cloud Data file format\n"
+          << "VERSION 0.7\n"
+          << "FIELDS x y z size rough stair agent\n"
+          << "SIZE 4 4 4 4 4 4 1\n"
+          << "TYPE F F F F F F U\n"
+          << "COUNT 1 1 1 1 1 1 1\n"
+          << "WIDTH " << count.str() << "\n"
+          << "HEIGHT 1\n"
+          << "VIEWPOINT 0 0 0 1 0 0 0\n"
+          << "POINTS " << count.str() << "\n"
+          << "DATA binary\n";
+      }
+      return h.str();
+    }
+
+    inline bool fileExists(const std::string& name) {
+      struct stat st;
+      return stat(name.c_str(), &st) == 0;
+    }
+
+    // IEEE half precision, rounding to nearest even
+    uint16_t floatToHalf(float f) {
+      uint32_t x;
+      memcpy(&x, &f, sizeof(x));
+      const uint16_t sign = (x >> 16) & 0x8000;
+      const uint32_t a = x & 0x7FFFFFFF;
+      if (a >= 0x7F800000) return sign | 0x7C00 | (a > 0x7F800000 ? 0x200 : 0); // inf, nan
+      if (a >= 0x477FF000) return sign | 0x7C00; // rounds past the largest half
+      if (a < 0x38800000) { // subnormal half
+        if (a < 0x33000000) return sign;
+        const uint32_t m = (a & 0x7FFFFF) | 0x800000;
+        const uint32_t shift = 126 - (a >> 23);
+        uint32_t h = m >> shift;
+        const uint32_t rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) h++;
+        return sign | h;
+      }
+      uint32_t h = (a - 0x38000000) >> 13;
+      const uint32_t rem = a & 0x1FFF;
+      if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+      return sign | h;
+    }
+
+    float halfToFloat(uint16_t h) {
+      const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+      const uint32_t e = (h >> 10) & 0x1F, m = h & 0x3FF;
+      if (e == 0) {
+        const float f = ldexp((float)m, -24);
+        return sign ? -f : f;
+      }
+      const uint32_t x = sign | ((e == 0x1F) ? 0x7F800000 | (m << 13) : ((e + 112) << 23) | (m << 13));
+      float f;
+      memcpy(&f, &x, sizeof(f));
+      return f;
+    }
+
+    // Decoded log-odds of a compact record, with the clamping bounds exact
+    inline float compactLogOdds(uint q, float lo, float hi) {
+      return (q == 255) ? hi : lo + q * ((hi - lo) / 255.0f);
+    }
+
+    // Depth of octomap trees, which bounds the explicit stacks of the iterative codecs
+    const unsigned int max_codec_depth = 16;
+
+    // splitmix64 finalizer, for the subtree hashes
+    inline uint64_t mixHash(uint64_t x) {
+      x ^= x >> 30;
+      x *= 0xbf58476d1ce4e5b9ull;
+      x ^= x >> 27;
+      x *= 0x94d049bb133111ebull;
+      return x ^ (x >> 31);
+    }
+
+    // Nodes and leafs described by a buffer of binning records: the root, and every known child
+    void countBinningRecords(const std::vector<char>& buf, uint bits_per_child, uint64_t& num_nodes, uint64_t& num_leafs) {
+      num_nodes = buf.empty() ? 0 : 1;
+      num_leafs = 0;
+      for (size_t pos=0; pos + bits_per_child <= buf.size(); pos += bits_per_child) {
+        for (uint i=0; i<8; i++) {
+          const uint bit = i * bits_per_child;
+          uint code = (unsigned char)buf[pos + bit / 8] >> (bit % 8);
+          if (bit % 8 == 7) code |= (unsigned char)buf[pos + bit / 8 + 1] << 1;
+          code &= 3;
+          if (code) num_nodes++;
+          if (code == 1 || code == 2) num_leafs++;
+        }
+      }
+    }
+
+    // Decoded stair log-odds of every stair field value, see RoughOcTree::stairBinValues
+    std::vector<float> stairBinLut(uint stair_bits, float clamping_min, float thres, float clamping_max) {
+      std::vector<float> lut(1u << stair_bits);
+      if (!stair_bits) return lut;
+      const uint steps = 1u << (stair_bits - 1);
+      for (uint j=0; j<steps; j++) {
+        const float mid = (j + 0.5f) / steps;
+        lut[j] = (j == 0) ? clamping_min : clamping_min + mid * (thres - clamping_min);
+        lut[steps + j] = (j == steps - 1) ? clamping_max : thres + mid * (clamping_max - thres);
+      }
+      return lut;
+    }
+
+    template <uint RoughBits, uint StairBits, typename Codec>
+    auto callBinningCodec(Codec& codec)
+        -> decltype(codec(std::integral_constant<uint, 0>(), std::integral_constant<uint, 0>())) {
+      return codec(std::integral_constant<uint, RoughBits>(), std::integral_constant<uint, StairBits>());
+    }
+
+    template <uint NumStairCodecs, typename Codec, size_t... I>
+    auto dispatchBinningCodec(uint rough_bits, uint stair_bits, Codec& codec, std::index_sequence<I...>)
+        -> decltype(codec(std::integral_constant<uint, 0>(), std::integral_constant<uint, 0>())) {
+      typedef decltype(codec(std::integral_constant<uint, 0>(), std::integral_constant<uint, 0>())) Result;
+      static Result (* const table[])(Codec&) = { &callBinningCodec<I / NumStairCodecs, I % NumStairCodecs, Codec>... };
+      return table[rough_bits * NumStairCodecs + stair_bits](codec);
+    }
+
+    // Runs codec(RoughBits, StairBits) with both bit counts as compile time constants, so every
+    // binning codec picks its instantiation from one table of 9 rough bit counts by NumStairCodecs
+    template <uint NumStairCodecs, typename Codec>
+    auto dispatchBinningCodec(uint rough_bits, uint stair_bits, Codec codec)
+        -> decltype(codec(std::integral_constant<uint, 0>(), std::integral_constant<uint, 0>())) {
+      assert(rough_bits <= 8 && stair_bits < NumStairCodecs);
+      return dispatchBinningCodec<NumStairCodecs>(rough_bits, stair_bits, codec,
+                                                  std::make_index_sequence<9 * NumStairCodecs>());
+    }
+  }
+
   // node implementation  --------------------------------------
   std::ostream& RoughOcTreeNode::writeData(std::ostream &s) const {
     s.write((const char*) &value, sizeof(value)); // occupancy
@@ -53,7 +408,7 @@ namespace octomap {
   }
 
   float RoughOcTreeNode::getAverageChildRough() const {
-    int m = 0;
+    double m = 0;
     int c = 0;
 
     if (children != NULL){
@@ -68,8 +423,7 @@ namespace octomap {
     }
 
     if (c > 0) {
-      m /= c;
-      return m;
+      return (float)(m / c);
     }
     else { // no child had a color other than white
       return NAN;
@@ -119,15 +473,15 @@ namespace octomap {
 
   // tree implementation  --------------------------------------
   RoughOcTree::RoughOcTree(double in_resolution)
-  : OccupancyOcTreeBase<RoughOcTreeNode>(in_resolution), bitmask(0xff) {
+  : OccupancyOcTreeBase<RoughOcTreeNode>(in_resolution) {
     roughOcTreeMemberInit.ensureLinking();
     binary_encoding_mode = RoughBinaryEncodingMode::BINNING;
     rough_binary_thres = 0.99;
     // Defaults for stock map - no rough bits
     num_binary_bins = 0;
     // We know these, but leaving the calculations for clarity.  They get set in setRoughEnabled()
-    if (num_binary_bins) binsize = 1 / (num_binary_bins - 1);
-    num_rough_bits = log2(num_binary_bins);
+    if (num_binary_bins) binsize = 1.0 / (num_binary_bins - 1);
+    num_rough_bits = num_binary_bins ? log2(num_binary_bins) : 0;
     updateNumBitsPerNode();
     // stair probability params
     stairs_clamping_thres_max = logodds(0.97);
@@ -137,6 +491,10 @@ namespace octomap {
     stairs_prob_miss_log = logodds(0.49);
   }
 
+  RoughOcTree::~RoughOcTree() {
+    closeJournal();
+  }
+
   float RoughOcTree::getNodeRough(const OcTreeKey& key) {
     RoughOcTreeNode* n = search (key);
     if (n != 0) {
@@ -149,6 +507,19 @@ namespace octomap {
     if (!isNodeCollapsible(node))
       return false;
 
+    if (update_key) {
+      countDepthOffPath(node, -1);
+    }
+    else {
+      // Without the key of the node, neither its depth nor the cached hashes along its path are known
+      invalidateDepthCounts();
+      if (!subtree_hashes.empty()) clearSubtreeHashes();
+    }
+    collapseNode(node);
+    return true;
+  }
+
+  void RoughOcTree::collapseNode(RoughOcTreeNode* node) {
     // set value to children's values (all assumed equal)
     node->copyData(*(getNodeChild(node, 0)));
 
@@ -161,8 +532,49 @@ namespace octomap {
     }
     delete[] node->children;
     node->children = NULL;
+  }
 
-    return true;
+  void RoughOcTree::expandNode(RoughOcTreeNode* node) {
+    if (!update_key) {
+      invalidateDepthCounts();
+      if (!subtree_hashes.empty()) clearSubtreeHashes();
+    }
+    OccupancyOcTreeBase<RoughOcTreeNode>::expandNode(node);
+    if (update_key)
+      countDepthOffPath(node, 1);
+  }
+
+  void RoughOcTree::prune() {
+    // octomap's prune, with the depth of every node at hand for the counts
+    if (!this->root)
+      return;
+    for (unsigned int depth=this->tree_depth-1; depth > 0; --depth) {
+      unsigned int num_pruned = 0;
+      pruneCountedRecurs(this->root, 0, depth, num_pruned);
+      if (num_pruned == 0) break;
+    }
+    // Drop the cache once rather than for every pruned node
+    clearSubtreeHashes();
+  }
+
+  void RoughOcTree::pruneCountedRecurs(RoughOcTreeNode* node, unsigned int depth, unsigned int max_depth,
+                                       unsigned int& num_pruned) {
+    if (depth < max_depth) {
+      for (unsigned int i=0; i<8; i++) {
+        if (this->nodeChildExists(node, i))
+          pruneCountedRecurs(this->getNodeChild(node, i), depth+1, max_depth, num_pruned);
+      }
+      return;
+    }
+    if (!isNodeCollapsible(node))
+      return;
+    countDepthNode(node, depth, -1);
+    for (unsigned int i=0; i<8; i++) {
+      countDepthNode(this->getNodeChild(node, i), depth+1, -1);
+    }
+    collapseNode(node);
+    countDepthNode(node, depth, 1);
+    num_pruned++;
   }
 
   bool RoughOcTree::isNodeCollapsible(const RoughOcTreeNode* node) const{
@@ -182,6 +594,14 @@ namespace octomap {
         return false;
     }
 
+    // subtrees still in a map file and unloaded tiles look like leaves
+    if (hasFileSubtrees()) {
+      for (unsigned int i = 0; i<8; i++) {
+        if (isFileSubtree(getNodeChild(node, i)))
+          return false;
+      }
+    }
+
     return true;
   }
 
@@ -196,6 +616,13 @@ namespace octomap {
       return node;
     }
 
+    if (hasFileSubtrees())
+      materializeSubtree(key);
+    markHashDirty(key);
+    markTileDirty(key);
+    journalUpdate(key, JOURNAL_OCCUPANCY, logOdds, NULL);
+    beginKeyedUpdate(key);
+
     bool createdRoot = false;
     if (this->root == NULL) {
       this->root = new RoughOcTreeNode();
@@ -203,7 +630,39 @@ namespace octomap {
       createdRoot = true;
     }
 
-    return updateNodeRecurs(this->root, createdRoot, key, 0, logOdds, 0);
+    RoughOcTreeNode* n = updateNodeRecurs(this->root, createdRoot, key, 0, logOdds, 0);
+    endKeyedUpdate();
+    return n;
+  }
+
+  RoughOcTreeNode* RoughOcTree::updateNode(const OcTreeKey& key, float log_odds_update, bool lazy_eval) {
+    if (hasFileSubtrees())
+      materializeSubtree(key);
+    markHashDirty(key);
+    markTileDirty(key);
+    journalUpdate(key, JOURNAL_OCCUPANCY, log_odds_update, NULL);
+    beginKeyedUpdate(key);
+    RoughOcTreeNode* n = OccupancyOcTreeBase<RoughOcTreeNode>::updateNode(key, log_odds_update, lazy_eval);
+    endKeyedUpdate();
+    return n;
+  }
+
+  RoughOcTreeNode* RoughOcTree::setNodeValue(const OcTreeKey& key, float log_odds_value, bool lazy_eval) {
+    if (hasFileSubtrees())
+      materializeSubtree(key);
+    markHashDirty(key);
+    markTileDirty(key);
+    beginKeyedUpdate(key);
+    RoughOcTreeNode* n = OccupancyOcTreeBase<RoughOcTreeNode>::setNodeValue(key, log_odds_value, lazy_eval);
+    endKeyedUpdate();
+    return n;
+  }
+
+  void RoughOcTree::updateNodeLogOdds(RoughOcTreeNode* node, const float& update) const {
+    // A keyed update counts its path again afterwards, integrateHit and integrateMiss do not
+    if (!update_key)
+      invalidateDepthCounts();
+    OccupancyOcTreeBase<RoughOcTreeNode>::updateNodeLogOdds(node, update);
   }
 
   RoughOcTreeNode* RoughOcTree::setNodeAgent(const OcTreeKey& key,
@@ -211,6 +670,8 @@ namespace octomap {
     RoughOcTreeNode* n = search (key);
     if (n != 0) {
       n->setAgent(agent);
+      recordChange(key);
+      journalUpdate(key, JOURNAL_AGENT, 0, n);
     }
     return n;
   }
@@ -220,6 +681,8 @@ namespace octomap {
     RoughOcTreeNode* n = search (key);
     if (n != 0) {
       n->setRough(rough);
+      recordChange(key);
+      journalUpdate(key, JOURNAL_ROUGH, 0, n);
     }
     return n;
   }
@@ -235,6 +698,8 @@ namespace octomap {
       else {
         n->setRough(rough);
       }
+      recordChange(key);
+      journalUpdate(key, JOURNAL_ROUGH, 0, n);
     }
     return n;
   }
@@ -253,6 +718,8 @@ namespace octomap {
       else {
         n->setRough(rough);
       }
+      recordChange(key);
+      journalUpdate(key, JOURNAL_ROUGH, 0, n);
     }
     return n;
   }
@@ -268,6 +735,8 @@ namespace octomap {
       if ( !((log_odds_update >= 0 && leaf->getStairLogOdds() >= this->stairs_clamping_thres_max)
         || (log_odds_update <= 0 && leaf->getStairLogOdds() <= this->stairs_clamping_thres_min)) ) {
         updateNodeStairLogOdds(leaf, log_odds_update);
+        recordChange(key);
+        journalUpdate(key, JOURNAL_STAIRS, 0, leaf);
       }
     }
 
@@ -286,6 +755,8 @@ namespace octomap {
     RoughOcTreeNode* n = search (key);
     if (n != 0) {
       n->setStairLogOdds(value);
+      recordChange(key);
+      journalUpdate(key, JOURNAL_STAIRS, 0, n);
       return n;
     }
     return NULL;
@@ -311,6 +782,10 @@ namespace octomap {
       return leaf;
     }
 
+    recordChange(key);
+    journalUpdate(key, JOURNAL_STAIR_UPDATE, log_odds_update, NULL);
+    beginKeyedUpdate(key);
+
     bool createdRoot = false;
     if (this->root == NULL){
       this->root = new RoughOcTreeNode();
@@ -318,7 +793,9 @@ namespace octomap {
       createdRoot = true;
     }
 
-    return updateNodeStairsRecurs(this->root, createdRoot, key, 0, log_odds_update);
+    RoughOcTreeNode* n = updateNodeStairsRecurs(this->root, createdRoot, key, 0, log_odds_update);
+    endKeyedUpdate();
+    return n;
   }
 
   RoughOcTreeNode* RoughOcTree::updateNodeStairsRecurs(RoughOcTreeNode* node, bool node_just_created, const OcTreeKey& key,
@@ -390,7 +867,9 @@ namespace octomap {
           }
         }
       }
+      countDepthNode(node, depth, -1);
       node->updateOccupancyChildren();
+      countDepthNode(node, depth, 1);
       node->updateRoughChildren();
       node->updateStairChildren();
     }
@@ -405,290 +884,3518 @@ namespace octomap {
     }
 
     // printf("New tree in readbinarydata\n");
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+    file_subtrees = FileSubtrees();
+    tiles = TileStore();
+
+    BinaryHeader header;
+    const bool has_header = readBinaryHeader(s, header);
+    if (!s)
+      return s;
+    binary_index_follows = has_header && header.subtree_index;
+    binary_inner_nodes_follow = has_header ? header.num_nodes - header.num_leafs : 0;
+    if (has_header) {
+      applyBinaryHeader(header);
+      if (header.num_nodes == 0)
+        return s;
+    }
 
+    // The decoders count the nodes they create on top of the root
     this->root = new RoughOcTreeNode();
+    this->tree_size = 1;
     this->readBinaryNode(s, this->root);
     this->size_changed = true;
-    this->tree_size = calcNumNodes();  // compute number of nodes
+    // A progressive stream may have been cut short on purpose
+    if (has_header && s && binary_encoding_mode != PROGRESSIVE_BINNING && this->tree_size != header.num_nodes) {
+      OCTOMAP_ERROR("Binary header announces %llu nodes, but %zu were decoded.\n",
+                    (unsigned long long)header.num_nodes, this->tree_size);
+      s.setstate(std::ios_base::failbit);
+    }
     return s;
   }
 
   std::ostream& RoughOcTree::writeBinaryData(std::ostream &s) {
+    if (!materializeAll()) {
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
     OCTOMAP_DEBUG("Writing %zu nodes to output stream...", this->size());
+    if (binaryHeaderEnabled())
+      writeBinaryHeader(s);
     if (this->root)
       this->writeBinaryNode(s, this->root);
     return s;
   }
 
-
-  std::istream& RoughOcTree::readBinaryNode(std::istream &s, RoughOcTreeNode* node) {
-    switch (binary_encoding_mode) {
-      case THRESHOLDING:
-        // printf("Reading binary node via thresholding.\n");
-        return readBinaryNodeViaThresholding(s, node);
-        break;
-      case BINNING:
-        // printf("Reading binary node via binning.\n");
-        return readBinaryNodeViaBinning(s, node);
-        break;
-      default:
-        OCTOMAP_ERROR("Invalid binary encoding mode.");
-        return s;
+  std::ostream& RoughOcTree::writeBinaryHeader(std::ostream &s) const {
+    size_t num_nodes = 0, num_leafs = 0;
+    if (this->root) {
+      if (binaryLeafDepth() < this->tree_depth) {
+        countNodesRecurs(this->root, 0, num_nodes, num_leafs);
+      }
+      else {
+        num_nodes = this->size();
+        num_leafs = this->getNumLeafNodes();
+      }
     }
+    return writeBinaryHeader(s, num_nodes, num_leafs, binaryStreamIndexed());
   }
 
-  std::ostream& RoughOcTree::writeBinaryNode(std::ostream &s, const RoughOcTreeNode* node) {
-    switch (binary_encoding_mode) {
-      case THRESHOLDING:
-        // printf("Writing binary node via thresholding.\n");
-        return writeBinaryNodeViaThresholding(s, node);
-        break;
-      case BINNING:
-        // printf("Writing binary node via binning.\n");
-        return writeBinaryNodeViaBinning(s, node);
-        break;
-      default:
-        OCTOMAP_ERROR("Invalid binary encoding mode.");
-        return s;
-    }
+  std::ostream& RoughOcTree::writeBinaryHeader(std::ostream &s, uint64_t num_nodes, uint64_t num_leafs,
+                                               bool subtree_index) const {
+    s.write(binary_header_magic, sizeof(binary_header_magic));
+    putLittleEndian(s, binary_header_version, 1);
+    const size_t table_size = rough_bin_values.size();
+    putLittleEndian(s, binary_header_fields_v3 + (table_size ? 4 * (2 * table_size - 1) : 0), 2);
+    putLittleEndian(s, binary_encoding_mode, 1);
+    putLittleEndian(s, (stairsEnabled ? 1 | (num_stair_bits - 1) << 1 : 0) | (subtree_index ? 8 : 0), 1);
+    putLittleEndian(s, num_binary_bins, 2);
+    putFloat(s, rough_binary_thres);
+    putFloat(s, this->occ_prob_thres_log);
+    putFloat(s, this->clamping_thres_min);
+    putFloat(s, this->clamping_thres_max);
+    putFloat(s, stairs_prob_thres_log);
+    putLittleEndian(s, num_nodes, 8);
+    putLittleEndian(s, num_leafs, 8);
+    putLittleEndian(s, table_size, 2);
+    for (size_t b=0; b<rough_bin_edges.size(); b++) putFloat(s, rough_bin_edges[b]);
+    for (size_t b=0; b<table_size; b++) putFloat(s, rough_bin_values[b]);
+    putFloat(s, stairs_clamping_thres_min);
+    putFloat(s, stairs_clamping_thres_max);
+    return s;
   }
 
-  std::istream& RoughOcTree::readBinaryNodeViaThresholding(std::istream &s, RoughOcTreeNode* node){
-
-    assert(node);
-
-    char childset1_char, childset2_char, childset3_char;
-    s.read((char*)&childset1_char, sizeof(char));
-    s.read((char*)&childset2_char, sizeof(char));
-    s.read((char*)&childset3_char, sizeof(char));
+  void RoughOcTree::countNodesRecurs(const RoughOcTreeNode* node, unsigned int depth,
+                                     size_t& num_nodes, size_t& num_leafs) const {
+    num_nodes++;
+    if (depth >= binaryLeafDepth() || !this->nodeHasChildren(node)) {
+      num_leafs++;
+      return;
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(node, i))
+        countNodesRecurs(this->getNodeChild(node, i), depth+1, num_nodes, num_leafs);
+    }
+  }
 
-    std::bitset<8> children[3];
-    children[0] = (unsigned long long) childset1_char;
-    children[1] = (unsigned long long) childset2_char;
-    children[2] = (unsigned long long) childset3_char;
-    auto children_access = [children](uint child, uint value){return children[(child*3+value)/8][(child*3+value)%8];}; // maps child and value indices to aligned char array, returns bitset reference
+  const std::vector<RoughOcTree::DepthCounts>& RoughOcTree::getDepthCounts() {
+    size_t counted = 0;
+    for (size_t d=0; depth_counts_valid && d<depth_counts.size(); d++) {
+      counted += depth_counts[d].inner + depth_counts[d].leafs;
+    }
+    if (!depth_counts_valid || depth_counts_occ_thres != this->occ_prob_thres_log || counted != this->tree_size) {
+      depth_counts.assign(this->tree_depth + 1, DepthCounts());
+      depth_counts_valid = true;
+      depth_counts_occ_thres = this->occ_prob_thres_log;
+      if (this->root)
+        countDepthSubtreeRecurs(this->root, 0, 1);
+    }
+    return depth_counts;
+  }
 
-    //     std::cout << "read:  "
-    //        << child1to4.to_string<char,std::char_traits<char>,std::allocator<char> >() << " "
-    //        << child5to8.to_string<char,std::char_traits<char>,std::allocator<char> >() << std::endl;
+  void RoughOcTree::countDepthNode(const RoughOcTreeNode* node, unsigned int depth, int sign) {
+    if (!depth_counts_valid)
+      return;
+    // a corrupt merge stream can nest nodes below the tree depth before it is rejected
+    if (depth > this->tree_depth) {
+      invalidateDepthCounts();
+      return;
+    }
+    DepthCounts& c = depth_counts[depth];
+    const bool occupied = this->isNodeOccupied(node);
+    if (!this->nodeHasChildren(node)) {
+      c.leafs += sign;
+      if (occupied) c.leafs_occupied += sign;
+      return;
+    }
+    c.inner += sign;
+    if (occupied) c.inner_occupied += sign;
+  }
 
+  void RoughOcTree::countDepthSubtreeRecurs(const RoughOcTreeNode* node, unsigned int depth, int sign) {
+    countDepthNode(node, depth, sign);
+    if (!depth_counts_valid || !this->nodeHasChildren(node))
+      return;
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(node, i))
+        countDepthSubtreeRecurs(this->getNodeChild(node, i), depth+1, sign);
+    }
+  }
 
-    // inner nodes default to occupied
-    node->setLogOdds(this->clamping_thres_max);
+  void RoughOcTree::countDepthPath(const OcTreeKey& key, int sign) {
+    if (!depth_counts_valid)
+      return;
+    const RoughOcTreeNode* node = this->root;
+    for (unsigned int d=0; node; d++) {
+      countDepthNode(node, d, sign);
+      if (d == this->tree_depth) break;
+      const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+      node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : NULL;
+    }
+  }
 
-    for (unsigned int i=0; i<8; i++) {
-      if ((children_access(i,0) == 1) && (children_access(i,1) == 0)) {
-        // child is free leaf
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(this->clamping_thres_min);
-      }
-      else if ((children_access(i,0) == 0) && (children_access(i,1) == 1)) {
-        // child is occupied leaf
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(this->clamping_thres_max);
-        if (children_access(i,2) == 1) { // if binarized child is rough, set rough value to binary thres
-          this->getNodeChild(node, i)->setRough(this->rough_binary_thres);
-        }
-        else { // else, set rough value to zero
-          this->getNodeChild(node, i)->setRough(0.0f);
+  void RoughOcTree::countDepthOffPath(const RoughOcTreeNode* node, int sign) {
+    if (!depth_counts_valid)
+      return;
+    const RoughOcTreeNode* n = this->root;
+    for (unsigned int d=0; n && d<this->tree_depth; d++) {
+      const unsigned int pos = computeChildIdx(*update_key, this->tree_depth - 1 - d);
+      if (n == node) {
+        for (unsigned int i=0; i<8; i++) {
+          if (i != pos && this->nodeChildExists(node, i))
+            countDepthNode(this->getNodeChild(node, i), d+1, sign);
         }
+        return;
       }
-      else if ((children_access(i,0) == 1) && (children_access(i,1) == 1)) {
-        // child has children
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(-200.); // child is unkown, we leave it uninitialized
-      }
+      n = this->nodeChildExists(n, pos) ? this->getNodeChild(n, pos) : NULL;
     }
-
-    // read children's children and set the label
-    for (unsigned int i=0; i<8; i++) {
-      if (this->nodeChildExists(node, i)) {
-        RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if (fabs(child->getLogOdds() + 200.)<1e-3) { // has children?
-          readBinaryNode(s, child);
-          child->setLogOdds(child->getMaxChildLogOdds());
-        }
-      } // end if child exists
-    } // end for children
-
-    return s;
+    invalidateDepthCounts();
   }
 
-  std::ostream& RoughOcTree::writeBinaryNodeViaThresholding(std::ostream &s, const RoughOcTreeNode* node) {
-
-    assert(node);
+  uint64_t RoughOcTree::estimateBinarySize(RoughBinaryEncodingMode mode, unsigned int max_depth, uint num_bins) {
+    if (mode != BINNING && mode != VARIABLE_BINNING)
+      return 0;
 
-    // 3 bits for each children, 8 children per node -> 24 bits
-    // std::bitset<8> childset1; // 1A 1B 1R 2A 2B 2R 3A 3B
-    // std::bitset<8> childset2;  // 3R 4A 4B 4R 5A 5B 5R 6A
-    // std::bitset<8> childset3;   // 6B 6R 7A 7B 7R 8A 8B 8R
-    std::bitset<8> children[3];
-    auto children_access = [&children] (uint child, uint value) {return children[(child*3+value)/8][(child*3+value)%8];}; // maps child and value indices to aligned char array, returns bitset reference
+    uint64_t size = 0;
+    if (binaryHeaderEnabled()) {
+      const size_t table_size = rough_bin_values.size();
+      size += sizeof(binary_header_magic) + 1 + 2 + binary_header_fields_v3 + (table_size ? 4 * (2 * table_size - 1) : 0);
+    }
+    if (!this->root)
+      return size;
 
-    // 10* : child is free node
-    // 01* : child is occupied node
-    // 00* : child is unkown node
-    // 11* : child has children
-    // **1 : child is rough
-    // **0 : child is traversable or traversability unknown (should be treated similarly)
+    const std::vector<DepthCounts>& counts = getDepthCounts();
+    const unsigned int leaf_depth = (max_depth && max_depth < this->tree_depth) ? max_depth : this->tree_depth;
+    const uint rough_bits = num_bins ? log2(num_bins) : 0;
 
-    // speedup: only set bits to 1, rest is init with 0 anyway,
-    //          can be one logic expression per bit
+    // One record per inner node above the leaf depth, and one for a root without children
+    uint64_t records = 0;
+    for (unsigned int d=0; d<leaf_depth; d++) records += counts[d].inner;
+    if (records == 0) records = 1;
 
-    for (unsigned int i=0; i<8; i++) {
-      if (this->nodeChildExists(node, i)) {
-        const RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if      (this->nodeHasChildren(child))  { children_access(i,0) = 1; children_access(i,1) = 1; }
-        else if (this->isNodeOccupied(child)) {
-          children_access(i,0) = 0; children_access(i,1) = 1;
-          if (child->getRough()>this->rough_binary_thres) { // fails if rough is nan or less than or equal to rough binary threshold
-            children_access(i,2) = 1; // set rough bit
-          }
-        }
-        else { children_access(i,0) = 1; children_access(i,1) = 0; }
-      }
-      else {
-        children_access(i,0) = 0; children_access(i,1) = 0; // shouldn't be necessary since default value is 0?
+    if (mode == BINNING) {
+      size += records * (2 + rough_bits + binaryStairBits());
+      // Split streams with an index end in one length per subtree at the split depth
+      if (binary_subtree_index && binary_split_depth > 0) {
+        size += subtree_index_footer;
+        if (binary_split_depth < leaf_depth) size += 8 * counts[binary_split_depth].inner;
       }
     }
+    else {
+      // 16 code bits per record, attribute bits per occupied child written as a leaf
+      uint64_t occupied = counts[leaf_depth].inner_occupied;
+      for (unsigned int d=1; d<=leaf_depth; d++) occupied += counts[d].leafs_occupied;
+      const uint64_t bits = records * 16 + occupied * (rough_bits + (this->stairsEnabled ? 1 : 0));
+      size += (bits + 7) / 8;
+    }
+    return size;
+  }
 
-    //     std::cout << "wrote: "
-    //        << child1to4.to_string<char,std::char_traits<char>,std::allocator<char> >() << " "
-    //        << child5to8.to_string<char,std::char_traits<char>,std::allocator<char> >() << std::endl;
-
-    char childset1_char = (char) children[0].to_ulong();
-    char childset2_char = (char) children[1].to_ulong();
-    char childset3_char = (char) children[2].to_ulong();
-
-    s.write((char*)&childset1_char, sizeof(char));
-    s.write((char*)&childset2_char, sizeof(char));
-    s.write((char*)&childset3_char, sizeof(char));
-
-    // write children's children
-    for (unsigned int i=0; i<8; i++) {
-      if (this->nodeChildExists(node, i)) {
-        const RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if (this->nodeHasChildren(child)) {
-          writeBinaryNode(s, child);
+  RoughOcTree::BinaryBudget RoughOcTree::chooseBinaryEncoding(uint64_t budget_bytes) {
+    const RoughBinaryEncodingMode modes[2] = { BINNING, VARIABLE_BINNING };
+    BinaryBudget choice;
+    for (unsigned int depth = binaryLeafDepth(); depth >= 1; depth--) {
+      for (uint bins = num_binary_bins; ; bins /= 2) {
+        for (unsigned int m=0; m<2; m++) {
+          choice.max_depth = depth;
+          choice.num_bins = bins;
+          choice.mode = modes[m];
+          choice.size = estimateBinarySize(choice.mode, depth, bins);
+          choice.fits = choice.size <= budget_bytes;
+          if (choice.fits)
+            return choice;
         }
+        if (bins <= 2 || roughQuantizationSet())
+          break;
       }
     }
-
-    return s;
+    // Nothing fits: the last one tried is the smallest
+    return choice;
   }
 
-  std::istream& RoughOcTree::readBinaryNodeViaBinning(std::istream &s, RoughOcTreeNode* node){
-
-    assert(node);
-
-    children.reset();
-    for (int i=0; i<num_bits_per_node; i++) {
-      // Read each char to our preallocated "byte"
-      char children_char;
-      s.read((char*)&children_char, sizeof(char));
-      read_byte = children_char;
-      // Mask the byte to only the 8 bits, then shift appropriately and add to this bitset
-      children |= (read_byte & bitmask) << (i * 8);
+  bool RoughOcTree::readBinaryHeader(std::istream &s, BinaryHeader& header) {
+    // Match the magic byte by byte, handing back what matched if it turns out not to be a header
+    std::streambuf* buf = s.rdbuf();
+    size_t matched = 0;
+    while (matched < sizeof(binary_header_magic) &&
+           buf->sgetc() == std::char_traits<char>::to_int_type(binary_header_magic[matched])) {
+      buf->sbumpc();
+      matched++;
     }
-
-    // inner nodes default to occupied
-    node->setLogOdds(this->clamping_thres_max);
-
-    for (unsigned int i=0; i<8; i++) {
-      const uint idx = i * num_bits_per_node;
-      if ((children[idx] == 1) && (children[idx + 1] == 0)) {
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(this->clamping_thres_min);
-      }
-      else if ((children[idx] == 0) && (children[idx + 1] == 1)) {
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(this->clamping_thres_max);
-
-        if (this->roughEnabled) {
-          for (uint j=0; j<num_rough_bits; j++) {
-            rough_bits[j] = children[idx + 2 + j];
-          }
-          this->getNodeChild(node, i)->setRough(rough_bits.to_ulong() * binsize);
-        }
-
-        if (this->stairsEnabled) {
-          if (children[idx + 2 + num_rough_bits] == 1) {
-            this->getNodeChild(node, i)->setStairLogOdds(this->stairs_clamping_thres_max);
-          } else {
-            this->getNodeChild(node, i)->setStairLogOdds(this->stairs_clamping_thres_min);
-          }
+    if (matched < sizeof(binary_header_magic)) {
+      while (matched > 0) {
+        if (buf->sputbackc(binary_header_magic[--matched]) == std::char_traits<char>::eof()) {
+          s.setstate(std::ios_base::badbit);
+          break;
         }
       }
-      else if ((children[idx] == 1) && (children[idx + 1] == 1)) {
-        this->createNodeChild(node, i);
-        this->getNodeChild(node, i)->setLogOdds(-200.);
-      }
+      return false;
+    }
+
+    char prefix[3];
+    if (!s.read(prefix, sizeof(prefix))) {
+      OCTOMAP_ERROR("Binary header is truncated.\n");
+      return false;
+    }
+    header.version = getLittleEndian(prefix, 1);
+    const size_t size = getLittleEndian(prefix + 1, 2);
+    std::vector<char> fields(size);
+    if (header.version < 1 || size < binary_header_fields_v1 || !s.read(fields.data(), size)) {
+      OCTOMAP_ERROR("Invalid binary header (version %u, %zu bytes).\n", header.version, size);
+      s.setstate(std::ios_base::failbit);
+      return false;
+    }
+    if (header.version > binary_header_version)
+      OCTOMAP_WARNING("Binary header version %u is newer than %u, ignoring the extra fields.\n",
+                      header.version, binary_header_version);
+
+    const char* f = fields.data();
+    header.mode = (RoughBinaryEncodingMode)getLittleEndian(f, 1);
+    const uint flags = getLittleEndian(f + 1, 1);
+    header.stairs = flags & 1;
+    header.stair_bits = header.stairs ? ((flags >> 1) & 3) + 1 : 1;
+    header.subtree_index = (flags >> 3) & 1;
+    header.num_bins = getLittleEndian(f + 2, 2);
+    header.rough_binary_thres = getFloat(f + 4);
+    header.occupancy_thres_log = getFloat(f + 8);
+    header.clamping_thres_min_log = getFloat(f + 12);
+    header.clamping_thres_max_log = getFloat(f + 16);
+    header.stairs_prob_thres_log = getFloat(f + 20);
+    header.num_nodes = getLittleEndian(f + 24, 8);
+    header.num_leafs = getLittleEndian(f + 32, 8);
+    // At most 8 children per inner node, so every inner node adds at most 7 leafs
+    const uint64_t num_inner = header.num_nodes - header.num_leafs;
+    if (header.num_leafs > header.num_nodes || (header.num_leafs > 1 && (header.num_leafs - 2) / 7 >= num_inner)) {
+      OCTOMAP_ERROR("Invalid binary header (%llu nodes, %llu leafs).\n", (unsigned long long)header.num_nodes,
+                    (unsigned long long)header.num_leafs);
+      s.setstate(std::ios_base::failbit);
+      return false;
+    }
+    if (header.mode > PROGRESSIVE_BINNING || header.num_bins > max_binary_bins || (header.num_bins & (header.num_bins - 1))) {
+      OCTOMAP_ERROR("Invalid binary header (mode %d, %u bins).\n", (int)header.mode, header.num_bins);
+      s.setstate(std::ios_base::failbit);
+      return false;
+    }
+
+    header.rough_bin_edges.clear();
+    header.rough_bin_values.clear();
+    header.stairs_clamping_thres_min_log = NAN;
+    header.stairs_clamping_thres_max_log = NAN;
+    if (header.version >= 2 && size >= binary_header_fields_v2) {
+      const size_t table_size = getLittleEndian(f + 40, 2);
+      const size_t table_bytes = table_size ? 4 * (2 * table_size - 1) : 0;
+      if (table_size) {
+        if (table_size != header.num_bins || size < binary_header_fields_v2 + table_bytes) {
+          OCTOMAP_ERROR("Invalid rough quantization table (%zu bins for %u).\n", table_size, header.num_bins);
+          s.setstate(std::ios_base::failbit);
+          return false;
+        }
+        const char* t = f + binary_header_fields_v2;
+        header.rough_bin_edges.resize(table_size - 1);
+        header.rough_bin_values.resize(table_size);
+        for (size_t b=0; b<table_size-1; b++, t += 4) header.rough_bin_edges[b] = getFloat(t);
+        for (size_t b=0; b<table_size; b++, t += 4) header.rough_bin_values[b] = getFloat(t);
+      }
+      if (!std::is_sorted(header.rough_bin_edges.begin(), header.rough_bin_edges.end())) {
+        OCTOMAP_ERROR("Invalid rough quantization table, the edges are not ascending.\n");
+        s.setstate(std::ios_base::failbit);
+        return false;
+      }
+      if (header.version >= 3) {
+        if (size < binary_header_fields_v3 + table_bytes) {
+          OCTOMAP_ERROR("Invalid binary header (version %u, %zu bytes).\n", header.version, size);
+          s.setstate(std::ios_base::failbit);
+          return false;
+        }
+        header.stairs_clamping_thres_min_log = getFloat(f + binary_header_fields_v2 + table_bytes);
+        header.stairs_clamping_thres_max_log = getFloat(f + binary_header_fields_v2 + table_bytes + 4);
+      }
+    }
+    return true;
+  }
+
+  void RoughOcTree::applyBinaryHeader(const BinaryHeader& header) {
+    binary_encoding_mode = header.mode;
+    setStairBits(header.stair_bits);
+    setStairsEnabled(header.stairs);
+    setNumBins(header.num_bins);
+    if (!header.num_bins) setRoughEnabled(false);
+    if (header.rough_bin_values.empty() || !setRoughQuantization(header.rough_bin_edges, header.rough_bin_values))
+      setUniformRoughQuantization();
+    rough_binary_thres = header.rough_binary_thres;
+    this->occ_prob_thres_log = header.occupancy_thres_log;
+    this->clamping_thres_min = header.clamping_thres_min_log;
+    this->clamping_thres_max = header.clamping_thres_max_log;
+    stairs_prob_thres_log = header.stairs_prob_thres_log;
+    if (header.version >= 3) {
+      stairs_clamping_thres_min = header.stairs_clamping_thres_min_log;
+      stairs_clamping_thres_max = header.stairs_clamping_thres_max_log;
+    }
+  }
+
+  bool RoughOcTree::setRoughQuantization(const std::vector<float>& edges, const std::vector<float>& values) {
+    if (num_binary_bins < 2 || values.size() != num_binary_bins || edges.size() != num_binary_bins - 1 ||
+        !std::is_sorted(edges.begin(), edges.end())) {
+      OCTOMAP_ERROR("A rough quantization table needs %u ascending edges and %u values, got %zu and %zu.\n",
+                    num_binary_bins ? num_binary_bins - 1 : 0, num_binary_bins, edges.size(), values.size());
+      return false;
+    }
+    rough_bin_edges = edges;
+    rough_bin_values = values;
+    rough_bin_lut.resize((size_t)rough_bin_lut_size);
+    for (uint k=0; k<rough_bin_lut_size; k++) {
+      const float lower = (float)k / rough_bin_lut_size;
+      rough_bin_lut[k] = std::upper_bound(edges.begin(), edges.end(), lower) - edges.begin();
+    }
+    clearSubtreeHashes();
+    return true;
+  }
+
+  void RoughOcTree::setUniformRoughQuantization() {
+    if (rough_bin_values.empty()) return;
+    rough_bin_edges.clear();
+    rough_bin_values.clear();
+    rough_bin_lut.clear();
+    clearSubtreeHashes();
+  }
+
+  bool RoughOcTree::setLogRoughQuantization(float min_rough) {
+    if (num_binary_bins < 2 || !(min_rough > 0 && min_rough < 1)) {
+      OCTOMAP_ERROR("Log rough quantization needs at least 2 bins and 0 < min_rough < 1.\n");
+      return false;
+    }
+    // Like the uniform bins, the last bin holds a rough of 1 and the first everything below
+    // min_rough; the bins between decode to the geometric middle of their range
+    const uint n = num_binary_bins;
+    std::vector<float> edges(n - 1, 1.0f);
+    std::vector<float> values(n, 0.0f);
+    for (uint j=0; j+1<n-1; j++) {
+      edges[j] = pow(min_rough, (double)(n - 2 - j) / (n - 2));
+    }
+    for (uint b=1; b<n-1; b++) {
+      values[b] = sqrt(edges[b - 1] * edges[b]);
+    }
+    values[n - 1] = 1.0f;
+    return setRoughQuantization(edges, values);
+  }
+
+  bool RoughOcTree::fitRoughQuantization() {
+    if (num_binary_bins < 2) {
+      OCTOMAP_ERROR("Fitting a rough quantization needs at least 2 bins.\n");
+      return false;
+    }
+
+    // Histogram of the rough values binning writes over the lookup buckets, with the sum of
+    // each bucket for the means
+    std::vector<uint64_t> counts(rough_bin_lut_size, 0);
+    std::vector<double> sums(rough_bin_lut_size, 0.0);
+    uint64_t total = 0;
+    if (this->root) {
+      for (leaf_iterator it = this->begin_leafs(binaryLeafDepth()), end = this->end_leafs(); it != end; ++it) {
+        if (!it->isRoughSet() || !this->isNodeOccupied(*it)) continue;
+        const float rough = it->getRough();
+        const int bucket = std::min(std::max((int)floor(rough * rough_bin_lut_size), 0), (int)rough_bin_lut_size - 1);
+        counts[bucket]++;
+        sums[bucket] += rough;
+        total++;
+      }
+    }
+    if (!total) {
+      OCTOMAP_ERROR("No occupied leaf has a rough value to fit the quantization to.\n");
+      return false;
+    }
+
+    // Close a bin once it holds its share of what the bins before left over, so that a value
+    // shared by many leafs cannot take up several bins
+    const uint n = num_binary_bins;
+    std::vector<float> edges, values;
+    uint64_t count = 0, left = total;
+    double sum = 0;
+    for (uint k=0; k<rough_bin_lut_size; k++) {
+      count += counts[k];
+      sum += sums[k];
+      if (edges.size() + 1 < n && count && count * (n - edges.size()) >= left) {
+        edges.push_back((float)(k + 1) / rough_bin_lut_size);
+        values.push_back(sum / count);
+        left -= count;
+        count = 0;
+        sum = 0;
+      }
+    }
+    // Fewer distinct buckets than bins leaves empty bins at the top edge
+    const float top = edges.empty() ? 0.0f : edges.back();
+    while (edges.size() + 1 < n) {
+      edges.push_back(top);
+      values.push_back(top);
+    }
+    values.push_back(count ? sum / count : top);
+    return setRoughQuantization(edges, values);
+  }
+
+  std::vector<float> RoughOcTree::stairBinValues(uint stair_bits) const {
+    return stairBinLut(stair_bits, stairs_clamping_thres_min, stairs_prob_thres_log, stairs_clamping_thres_max);
+  }
+
+  std::vector<float> RoughOcTree::roughBinValues() const {
+    // Looked up per child instead of multiplied out
+    if (!rough_bin_values.empty())
+      return rough_bin_values;
+    std::vector<float> lut(1u << num_rough_bits);
+    for (uint b=0; b<lut.size(); b++) {
+      lut[b] = b * binsize;
+    }
+    return lut;
+  }
+
+  void RoughOcTree::binaryHeaderLuts(const BinaryHeader& header, uint& rough_bits, uint& stair_bits,
+                                     std::vector<float>& rough_lut, std::vector<float>& stair_lut) const {
+    rough_bits = header.num_bins ? log2(header.num_bins) : 0;
+    stair_bits = header.stairs ? header.stair_bits : 0;
+    if (!header.rough_bin_values.empty()) {
+      rough_lut = header.rough_bin_values;
+    }
+    else {
+      // as roughBinValues with the header's bins
+      const double binsize = header.num_bins > 1 ? 1.0 / (header.num_bins - 1) : 0.0;
+      rough_lut.resize(1u << rough_bits);
+      for (uint b=0; b<rough_lut.size(); b++) {
+        rough_lut[b] = b * binsize;
+      }
+    }
+    const float clamping_min = isnan(header.stairs_clamping_thres_min_log) ? stairs_clamping_thres_min
+                                                                          : header.stairs_clamping_thres_min_log;
+    const float clamping_max = isnan(header.stairs_clamping_thres_max_log) ? stairs_clamping_thres_max
+                                                                          : header.stairs_clamping_thres_max_log;
+    stair_lut = stairBinLut(stair_bits, clamping_min, header.stairs_prob_thres_log, clamping_max);
+  }
+
+
+  std::ostream& RoughOcTree::writeCompactData(std::ostream &s) const {
+    const float lo = this->clamping_thres_min, hi = this->clamping_thres_max;
+    const float scale = (hi > lo) ? 255.0f / (hi - lo) : 0.0f;
+    const float thres = this->occ_prob_thres_log;
+
+    std::vector<char> buf;
+    buf.insert(buf.end(), compact_magic, compact_magic + sizeof(compact_magic));
+    buf.push_back((char)compact_version);
+    const float bounds[2] = { lo, hi };
+    for (uint k=0; k<2; k++) {
+      uint32_t bits;
+      memcpy(&bits, &bounds[k], sizeof(bits));
+      for (uint b=0; b<4; b++) buf.push_back((char)(bits >> (8 * b)));
+    }
+    const size_t count_pos = buf.size();
+    buf.resize(count_pos + 8 + (this->root ? this->tree_size : 0) * compact_node_size);
+
+    // Pre-order over an explicit stack of the nodes whose children are still to be written
+    struct Frame {
+      const RoughOcTreeNode* node;
+      unsigned int children; // bit mask
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+    uint64_t count = 0;
+    const RoughOcTreeNode* pending = this->root;
+    while (pending) {
+      unsigned int children = 0;
+      for (unsigned int i=0; i<8; i++) {
+        if (this->nodeChildExists(pending, i)) children |= 1u << i;
+      }
+
+      const float l = pending->getLogOdds();
+      int q = std::min(std::max((int)floor((l - lo) * scale + 0.5f), 0), 255);
+      if ((compactLogOdds(q, lo, hi) >= thres) != (l >= thres))
+        q = std::min(std::max(q + ((l >= thres) ? 1 : -1), 0), 255);
+      const uint16_t rough = floatToHalf(pending->getRough());
+      const uint16_t stairs = floatToHalf(pending->getStairLogOdds());
+      // tree_size sizes the buffer up front, but may be stale
+      const size_t pos = count_pos + 8 + count * compact_node_size;
+      if (pos + compact_node_size > buf.size()) buf.resize(pos + compact_node_size);
+      char* record = &buf[pos];
+      record[0] = (char)children;
+      record[1] = (char)q;
+      record[2] = (char)rough;
+      record[3] = (char)(rough >> 8);
+      record[4] = (char)stairs;
+      record[5] = (char)(stairs >> 8);
+      record[6] = pending->getAgent();
+      count++;
+
+      if (children && top < (int)max_codec_depth) {
+        stack[++top].node = pending;
+        stack[top].children = children;
+      }
+      pending = NULL;
+      while (top >= 0 && !pending) {
+        Frame& f = stack[top];
+        if (!f.children) {
+          top--;
+          continue;
+        }
+        unsigned int i = 0;
+        while (!((f.children >> i) & 1)) i++;
+        f.children &= f.children - 1;
+        pending = this->getNodeChild(f.node, i);
+      }
+    }
+
+    for (uint b=0; b<8; b++) buf[count_pos + b] = (char)(count >> (8 * b));
+    s.write(buf.data(), count_pos + 8 + count * compact_node_size);
+    return s;
+  }
+
+  std::istream& RoughOcTree::readCompactData(std::istream &s) {
+    // tree needs to be newly created or cleared externally
+    if (this->root) {
+      OCTOMAP_ERROR_STR("Trying to read into an existing tree.");
+      return s;
+    }
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+    file_subtrees = FileSubtrees();
+    tiles = TileStore();
+
+    std::vector<char> buf;
+    readRemaining(s, buf);
+    if (buf.size() < compact_header_size || memcmp(buf.data(), compact_magic, sizeof(compact_magic)) != 0 ||
+        (unsigned char)buf[sizeof(compact_magic)] != compact_version) {
+      OCTOMAP_ERROR("Not a compact map stream (version %u).\n", compact_version);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    const char* data = buf.data() + sizeof(compact_magic) + 1;
+    const float lo = getFloat(data), hi = getFloat(data + 4);
+    const uint64_t num_nodes = getLittleEndian(data + 8, 8);
+    data += 16;
+    const char* end = buf.data() + buf.size();
+    if (num_nodes > (uint64_t)(end - data) / compact_node_size) {
+      OCTOMAP_ERROR("Compact map stream is truncated.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    if (!num_nodes) {
+      unreadRemaining(s, end - data);
+      return s;
+    }
+
+    float log_odds[256];
+    for (uint q=0; q<256; q++) {
+      log_odds[q] = compactLogOdds(q, lo, hi);
+    }
+
+    // Same walk as the writer, creating each child as its record comes up
+    struct Frame {
+      RoughOcTreeNode* node;
+      unsigned int children; // bit mask
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+    bool valid = true;
+    this->root = new RoughOcTreeNode();
+    this->tree_size = 1;
+    RoughOcTreeNode* pending = this->root;
+    for (uint64_t n=0; n<num_nodes; n++) {
+      if (!pending) {
+        valid = false;
+        break;
+      }
+      const unsigned char* record = (const unsigned char*)data;
+      data += compact_node_size;
+      const unsigned int children = record[0];
+      pending->setLogOdds(log_odds[record[1]]);
+      pending->setRough(halfToFloat(record[2] | record[3] << 8));
+      pending->setStairLogOdds(halfToFloat(record[4] | record[5] << 8));
+      pending->setAgent((char)record[6]);
+
+      if (children) {
+        if (top == (int)max_codec_depth) {
+          valid = false;
+          break;
+        }
+        stack[++top].node = pending;
+        stack[top].children = children;
+      }
+      pending = NULL;
+      while (top >= 0 && !pending) {
+        Frame& f = stack[top];
+        if (!f.children) {
+          top--;
+          continue;
+        }
+        unsigned int i = 0;
+        while (!((f.children >> i) & 1)) i++;
+        f.children &= f.children - 1;
+        pending = allocNodeChild(f.node, i, this->tree_size);
+      }
+    }
+    this->size_changed = true;
+    if (pending || !valid) {
+      OCTOMAP_ERROR("Compact map stream does not describe a complete tree.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    unreadRemaining(s, end - data);
+    return s;
+  }
+
+  bool RoughOcTree::writeMapFile(const std::string& filename) {
+    if (binary_split_depth == 0 || binary_split_depth >= this->tree_depth) {
+      OCTOMAP_ERROR("Map files need a split depth between 1 and %u, got %u.\n", this->tree_depth - 1, binary_split_depth);
+      return false;
+    }
+    if (!materializeAll())
+      return false;
+
+    std::ofstream file(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!file.is_open()) {
+      OCTOMAP_ERROR_STR("Filestream to " << filename << " not open, nothing written.");
+      return false;
+    }
+
+    const RoughBinaryEncodingMode full_mode = binary_encoding_mode;
+    const bool full_index = binary_subtree_index, full_header = binary_header;
+    const unsigned int full_max_depth = binary_max_depth;
+    binary_encoding_mode = BINNING;
+    binary_subtree_index = true;
+    binary_header = true;
+    binary_max_depth = 0;
+
+    // The subtrees at the split depth in stream order, as the encoder splits them off
+    std::vector<char> top;
+    std::vector<std::pair<size_t, const RoughOcTreeNode*> > jobs;
+    if (this->root)
+      encodeBinaryNodeViaBinning(top, this->root, binary_split_depth, &jobs);
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    std::vector<char> prefix(map_file_prefix + jobs.size() * map_file_summary_size);
+    memcpy(&prefix[0], map_file_magic, sizeof(map_file_magic));
+    prefix[4] = (char)map_file_version;
+    prefix[5] = (char)binary_split_depth;
+    for (uint b=0; b<4; b++) prefix[6 + b] = (char)(jobs.size() >> (8 * b));
+    for (size_t j=0; j<jobs.size(); j++) {
+      bool occupied = false;
+      float stair = -std::numeric_limits<float>::max();
+      fileSubtreeSummaryRecurs(jobs[j].second, this->stairsEnabled ? stair_lut.data() : NULL, occupied, stair);
+      uint32_t bits;
+      memcpy(&bits, &stair, sizeof(bits));
+      char* summary = &prefix[map_file_prefix + j * map_file_summary_size];
+      summary[0] = occupied;
+      for (uint b=0; b<4; b++) summary[1 + b] = (char)(bits >> (8 * b));
+    }
+    file.write(prefix.data(), prefix.size());
+    writeBinaryData(file);
+
+    binary_encoding_mode = full_mode;
+    binary_subtree_index = full_index;
+    binary_header = full_header;
+    binary_max_depth = full_max_depth;
+    file.close();
+    return file.good();
+  }
+
+  void RoughOcTree::fileSubtreeSummaryRecurs(const RoughOcTreeNode* node, const float* stair_lut,
+                                             bool& occupied, float& stair) const {
+    if (this->nodeHasChildren(node)) {
+      for (unsigned int i=0; i<8; i++) {
+        if (this->nodeChildExists(node, i))
+          fileSubtreeSummaryRecurs(this->getNodeChild(node, i), stair_lut, occupied, stair);
+      }
+      return;
+    }
+    // Leaves decode to the clamping bounds, and only occupied ones carry their stair field.
+    // Inner nodes decode to the maximum of their children.
+    float l = 0;
+    if (this->isNodeOccupied(node)) {
+      occupied = true;
+      if (stair_lut) l = stair_lut[stairBin(node, binaryStairBits())];
+    }
+    stair = std::max(stair, l);
+  }
+
+  bool RoughOcTree::openMapFile(const std::string& filename) {
+    // tree needs to be newly created or cleared externally
+    if (this->root) {
+      OCTOMAP_ERROR_STR("Trying to read into an existing tree.");
+      return false;
+    }
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      OCTOMAP_ERROR_STR("Filestream to " << filename << " not open, nothing read.");
+      return false;
+    }
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      OCTOMAP_ERROR_STR("Could not map " << filename << ".");
+      return false;
+    }
+    const size_t size = st.st_size;
+    FileSubtrees subtrees;
+    subtrees.file = std::shared_ptr<const char>((const char*)addr, [size](const char* p) { munmap((void*)p, size); });
+
+    const char* data = subtrees.file.get();
+    const char* end = data + size;
+    if (size < map_file_prefix || memcmp(data, map_file_magic, sizeof(map_file_magic)) != 0 ||
+        (unsigned char)data[4] != map_file_version) {
+      OCTOMAP_ERROR("Not a map file (version %u).\n", map_file_version);
+      return false;
+    }
+    subtrees.depth = (unsigned char)data[5];
+    const uint64_t count = getLittleEndian(data + 6, 4);
+    const char* summaries = data + map_file_prefix;
+    if (subtrees.depth == 0 || subtrees.depth >= this->tree_depth ||
+        count > (size - map_file_prefix) / map_file_summary_size) {
+      OCTOMAP_ERROR("Invalid map file (split depth %u, %lu subtrees).\n", subtrees.depth, (unsigned long)count);
+      return false;
+    }
+    data = summaries + count * map_file_summary_size;
+
+    // The header is small, so parse it from a copy
+    BinaryHeader header;
+    const size_t header_size = end - data >= 7 ? 7 + getLittleEndian(data + 5, 2) : 0;
+    std::istringstream header_stream(std::string(data, std::min(header_size, (size_t)(end - data))));
+    if (!readBinaryHeader(header_stream, header) || header.mode != BINNING || !header.subtree_index) {
+      OCTOMAP_ERROR("Map file has no binning header with a subtree index.\n");
+      return false;
+    }
+    data += header_size;
+
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+    file_subtrees = FileSubtrees();
+    tiles = TileStore();
+    applyBinaryHeader(header);
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      return false;
+    }
+    if (header.num_nodes == 0)
+      return true;
+
+    BinarySubtreeIndex index;
+    if (!readSubtreeIndex(data, end, index.depth, index.lengths) || index.depth != subtrees.depth ||
+        index.lengths.size() != count) {
+      OCTOMAP_ERROR("Map file subtree index does not match its summaries.\n");
+      return false;
+    }
+    subtrees.rough_bits = num_rough_bits;
+    subtrees.stair_bits = binaryStairBits();
+    subtrees.rough_lut = roughBinValues();
+    subtrees.stair_lut = stairBinValues(subtrees.stair_bits);
+
+    // Only the records above the split depth are decoded, the subtrees are left as jobs
+    this->root = new RoughOcTreeNode();
+    this->tree_size = 1;
+    index.jobs.reserve(count);
+    if (decodeBinningStream(data, end, this->root, this->tree_size, &index, subtrees.rough_bits, subtrees.stair_bits,
+                            subtrees.rough_lut.data(), subtrees.stair_lut.data()) != end) {
+      OCTOMAP_ERROR("Map file does not match its subtree index.\n");
+      this->clear();
+      return false;
+    }
+    for (size_t j=0; j<index.jobs.size(); j++) {
+      const BinarySubtreeJob& job = index.jobs[j];
+      const char* summary = summaries + j * map_file_summary_size;
+      this->allocNodeChildren(job.node);
+      job.node->setLogOdds(summary[0] ? this->clamping_thres_max : this->clamping_thres_min);
+      job.node->setStairLogOdds(getFloat(summary + 1));
+      subtrees.pending[job.key] = std::make_pair(job.data, job.length);
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(this->root, i))
+        updateInnerBinningRecurs(this->getNodeChild(this->root, i), 1, subtrees.depth);
+    }
+    this->size_changed = true;
+    if (!subtrees.pending.empty())
+      file_subtrees = subtrees;
+    return true;
+  }
+
+  RoughOcTreeNode* RoughOcTree::fileSubtreeNode(const OcTreeKey& key, unsigned int depth) {
+    RoughOcTreeNode* node = this->root;
+    for (unsigned int d=0; node && d<depth; d++) {
+      const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+      node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : NULL;
+    }
+    // Skip subtrees replaced since
+    return (node && isFileSubtree(node)) ? node : NULL;
+  }
+
+  bool RoughOcTree::materializeSubtree(const OcTreeKey& key, unsigned int depth) {
+    bool ok = true;
+    if (!tiles.unloaded.empty() && (depth == 0 || depth > tiles.depth))
+      ok = loadTile(key);
+    if (file_subtrees.pending.empty() || (depth != 0 && depth <= file_subtrees.depth))
+      return ok;
+    const auto it = file_subtrees.pending.find(hashKey(key, file_subtrees.depth));
+    if (it == file_subtrees.pending.end())
+      return ok;
+    const char* data = it->second.first;
+    const char* end = data + it->second.second;
+    file_subtrees.pending.erase(it);
+
+    RoughOcTreeNode* node = fileSubtreeNode(key, file_subtrees.depth);
+    if (node) {
+      countDepthNode(node, file_subtrees.depth, -1);
+      if (decodeBinningStream(data, end, node, this->tree_size, NULL, file_subtrees.rough_bits, file_subtrees.stair_bits,
+                              file_subtrees.rough_lut.data(), file_subtrees.stair_lut.data()) != end) {
+        OCTOMAP_ERROR("Map file subtree is corrupt.\n");
+        ok = false;
+      }
+      if (this->nodeHasChildren(node)) {
+        node->setLogOdds(node->getMaxChildLogOdds());
+        node->setStairLogOdds(node->getMaxChildStairLogOdds());
+      }
+      countDepthSubtreeRecurs(node, file_subtrees.depth, 1);
+      this->size_changed = true;
+      markHashDirty(key);
+    }
+    if (file_subtrees.pending.empty())
+      file_subtrees = FileSubtrees();
+    return ok;
+  }
+
+  bool RoughOcTree::materializeAll() {
+    bool ok = true;
+    const std::vector<OcTreeKey> unloaded(tiles.unloaded.begin(), tiles.unloaded.end());
+    for (size_t t=0; t<unloaded.size(); t++) {
+      ok = loadTile(unloaded[t]) && ok;
+    }
+    if (file_subtrees.pending.empty())
+      return ok;
+
+    // Decoded in parallel, like the subtrees of an indexed stream
+    std::vector<BinarySubtreeJob> jobs;
+    jobs.reserve(file_subtrees.pending.size());
+    for (const auto& p : file_subtrees.pending) {
+      RoughOcTreeNode* node = fileSubtreeNode(p.first, file_subtrees.depth);
+      if (node) {
+        BinarySubtreeJob job = { node, p.first, p.second.first, p.second.second };
+        jobs.push_back(job);
+        countDepthNode(node, file_subtrees.depth, -1);
+      }
+    }
+
+    const unsigned int threads = binary_encoding_threads ? binary_encoding_threads : std::thread::hardware_concurrency();
+    std::atomic<size_t> next_job(0);
+    std::atomic<size_t> decoded(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+      size_t num_nodes = 0;
+      for (size_t j = next_job++; j < jobs.size(); j = next_job++) {
+        const BinarySubtreeJob& job = jobs[j];
+        if (decodeBinningStream(job.data, job.data + job.length, job.node, num_nodes, NULL, file_subtrees.rough_bits,
+                                file_subtrees.stair_bits, file_subtrees.rough_lut.data(),
+                                file_subtrees.stair_lut.data()) != job.data + job.length)
+          failed = true;
+        if (this->nodeHasChildren(job.node)) {
+          job.node->setLogOdds(job.node->getMaxChildLogOdds());
+          job.node->setStairLogOdds(job.node->getMaxChildStairLogOdds());
+        }
+      }
+      decoded += num_nodes;
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int t=1; t<threads && t<jobs.size(); t++) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for (size_t t=0; t<pool.size(); t++) {
+      pool[t].join();
+    }
+    for (size_t j=0; depth_counts_valid && j<jobs.size(); j++) {
+      countDepthSubtreeRecurs(jobs[j].node, file_subtrees.depth, 1);
+    }
+
+    file_subtrees = FileSubtrees();
+    clearSubtreeHashes();
+    this->size_changed = true;
+    this->tree_size += decoded;
+    if (failed) {
+      OCTOMAP_ERROR("Map file subtree is corrupt.\n");
+      return false;
+    }
+    return ok;
+  }
+
+  bool RoughOcTree::materializeBox(const OcTreeKey& min, const OcTreeKey& max) {
+    std::vector<OcTreeKey> keys;
+    auto collect = [&](const OcTreeKey& key, unsigned int depth) {
+      const key_type mask = (key_type)((1u << (this->tree_depth - depth)) - 1);
+      for (unsigned int i=0; i<3; i++) {
+        if ((key_type)(key[i] | mask) < min[i] || (key_type)(key[i] & ~mask) > max[i]) return;
+      }
+      keys.push_back(key);
+    };
+    for (const OcTreeKey& key : tiles.unloaded) collect(key, tiles.depth);
+    for (const auto& p : file_subtrees.pending) collect(p.first, file_subtrees.depth);
+    bool ok = true;
+    for (size_t k=0; k<keys.size(); k++) {
+      ok = materializeSubtree(keys[k]) && ok;
+    }
+    return ok;
+  }
+
+  bool RoughOcTree::materializeNodeBox(const OcTreeKey& key, unsigned int depth) {
+    const key_type mask = (key_type)((1u << (this->tree_depth - depth)) - 1);
+    OcTreeKey min, max;
+    for (unsigned int i=0; i<3; i++) {
+      min[i] = key[i] & ~mask;
+      max[i] = key[i] | mask;
+    }
+    return materializeBox(min, max);
+  }
+
+  void RoughOcTree::materializeRay(const point3d& origin, const point3d& direction, double max_range, unsigned int depth) {
+    const double length = direction.norm();
+    if (length <= 0) return;
+    const unsigned int shift = this->tree_depth - depth;
+    const double cell = this->resolution * (1u << shift);
+    const double half = this->tree_max_val * this->resolution;
+    const int cells = 1 << depth;
+    int idx[3], step[3];
+    double t_next[3], t_delta[3];
+    for (unsigned int i=0; i<3; i++) {
+      const double d = direction(i) / length;
+      idx[i] = (int)floor((origin(i) + half) / cell);
+      if (idx[i] < 0 || idx[i] >= cells) return;
+      step[i] = d > 0 ? 1 : -1;
+      t_next[i] = d != 0 ? ((idx[i] + (d > 0)) * cell - half - origin(i)) / d : std::numeric_limits<double>::infinity();
+      t_delta[i] = d != 0 ? cell / fabs(d) : std::numeric_limits<double>::infinity();
+    }
+    for (;;) {
+      materializeSubtree(OcTreeKey(idx[0] << shift, idx[1] << shift, idx[2] << shift));
+      const unsigned int a = (t_next[0] < t_next[1]) ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+      if (max_range > 0 && t_next[a] > max_range) return;
+      idx[a] += step[a];
+      if (idx[a] < 0 || idx[a] >= cells) return;
+      t_next[a] += t_delta[a];
+    }
+  }
+
+  bool RoughOcTree::castRay(const point3d& origin, const point3d& direction, point3d& end,
+                            bool ignoreUnknownCells, double maxRange) const {
+    if (!tiles.unloaded.empty())
+      const_cast<RoughOcTree*>(this)->materializeRay(origin, direction, maxRange, tiles.depth);
+    if (!file_subtrees.pending.empty())
+      const_cast<RoughOcTree*>(this)->materializeRay(origin, direction, maxRange, file_subtrees.depth);
+    return OccupancyOcTreeBase<RoughOcTreeNode>::castRay(origin, direction, end, ignoreUnknownCells, maxRange);
+  }
+
+  void RoughOcTree::expand() {
+    // Expanding a pending subtree would replace it with copies of its summary
+    materializeAll();
+    if (this->root)
+      expandCountedRecurs(this->root, 0);
+    clearSubtreeHashes();
+  }
+
+  void RoughOcTree::expandCountedRecurs(RoughOcTreeNode* node, unsigned int depth) {
+    // octomap's expandRecurs, counting the nodes it creates
+    if (depth >= this->tree_depth)
+      return;
+    if (!this->nodeHasChildren(node)) {
+      countDepthNode(node, depth, -1);
+      OccupancyOcTreeBase<RoughOcTreeNode>::expandNode(node);
+      countDepthNode(node, depth, 1);
+      for (unsigned int i=0; i<8; i++) {
+        countDepthNode(this->getNodeChild(node, i), depth+1, 1);
+      }
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(node, i))
+        expandCountedRecurs(this->getNodeChild(node, i), depth+1);
+    }
+  }
+
+  bool RoughOcTree::createTileStore(const std::string& directory, unsigned int tile_depth) {
+    if (tile_depth == 0 || tile_depth >= this->tree_depth) {
+      OCTOMAP_ERROR("Tile depth must be between 1 and %u, got %u.\n", this->tree_depth - 1, tile_depth);
+      return false;
+    }
+    if (!materializeAll())
+      return false;
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      OCTOMAP_ERROR_STR("Could not create tile directory " << directory << ".");
+      return false;
+    }
+
+    tiles = TileStore();
+    tiles.active = true;
+    tiles.directory = directory;
+    tiles.depth = tile_depth;
+    std::vector<TileNode> tile_nodes, leaves;
+    if (this->root) {
+      const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+      collectTilesRecurs(this->root, 0, root_key, tile_nodes, leaves);
+    }
+    for (size_t t=0; t<tile_nodes.size(); t++) {
+      tiles.dirty.insert(tile_nodes[t].key);
+    }
+    return saveTiles();
+  }
+
+  void RoughOcTree::collectTilesRecurs(RoughOcTreeNode* node, unsigned int depth, const OcTreeKey& key,
+                                       std::vector<TileNode>& tile_nodes, std::vector<TileNode>& leaves) {
+    const TileNode n = { key, depth, node };
+    if (!this->nodeHasChildren(node) && !isFileSubtree(node)) {
+      leaves.push_back(n);
+      return;
+    }
+    if (depth == tiles.depth) {
+      tile_nodes.push_back(n);
+      return;
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth+1), key, child_key);
+      collectTilesRecurs(this->getNodeChild(node, i), depth+1, child_key, tile_nodes, leaves);
+    }
+  }
+
+  std::string RoughOcTree::tileFileName(const OcTreeKey& key) const {
+    std::ostringstream name;
+    name << tiles.directory << "/" << key[0] << "_" << key[1] << "_" << key[2] << ".tile";
+    return name.str();
+  }
+
+  bool RoughOcTree::writeTile(const OcTreeKey& key, const RoughOcTreeNode* node) {
+    const RoughBinaryEncodingMode full_mode = binary_encoding_mode;
+    const unsigned int full_max_depth = binary_max_depth;
+    binary_encoding_mode = BINNING;
+    binary_max_depth = 0;
+
+    size_t num_nodes = 0, num_leafs = 0;
+    countNodesRecurs(node, tiles.depth, num_nodes, num_leafs);
+    std::vector<char> buf;
+    buf.reserve((num_nodes / 8 + 1) * num_bits_per_node);
+    encodeBinaryNodeViaBinning(buf, node, 0, NULL, tiles.depth);
+
+    // Written next to the old tile and moved over it, so a crash leaves one or the other
+    const std::string name = tileFileName(key);
+    std::ofstream file((name + ".tmp").c_str(), std::ios_base::out | std::ios_base::binary);
+    writeBinaryHeader(file, num_nodes, num_leafs);
+    file.write(buf.data(), buf.size());
+    file.close();
+
+    binary_encoding_mode = full_mode;
+    binary_max_depth = full_max_depth;
+    if (!file.good() || std::rename((name + ".tmp").c_str(), name.c_str()) != 0) {
+      OCTOMAP_ERROR_STR("Could not write tile " << name << ".");
+      return false;
+    }
+    return true;
+  }
+
+  bool RoughOcTree::saveTiles() {
+    if (!tiles.active) {
+      OCTOMAP_ERROR("No tile store to save to.\n");
+      return false;
+    }
+
+    std::vector<TileNode> tile_nodes, leaves;
+    if (this->root) {
+      const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+      collectTilesRecurs(this->root, 0, root_key, tile_nodes, leaves);
+    }
+
+    bool ok = true;
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    std::ostringstream index;
+    index.write(tile_index_magic, sizeof(tile_index_magic));
+    putLittleEndian(index, tile_index_version, 1);
+    putLittleEndian(index, tiles.depth, 1);
+    putLittleEndian(index, tile_nodes.size(), 4);
+    putLittleEndian(index, leaves.size(), 4);
+    KeySet stored;
+    for (size_t t=0; t<tile_nodes.size(); t++) {
+      const TileNode& tile = tile_nodes[t];
+      bool occupied = this->isNodeOccupied(tile.node);
+      float stair = tile.node->getStairLogOdds();
+      if (!isFileSubtree(tile.node)) {
+        // Loaded: summarized as it will decode, and written if it changed
+        occupied = false;
+        stair = -std::numeric_limits<float>::max();
+        fileSubtreeSummaryRecurs(tile.node, this->stairsEnabled ? stair_lut.data() : NULL, occupied, stair);
+        if (tiles.dirty.count(tile.key) || !tiles.stored.count(tile.key))
+          ok = writeTile(tile.key, tile.node) && ok;
+      }
+      for (unsigned int a=0; a<3; a++) putLittleEndian(index, tile.key[a], 2);
+      putLittleEndian(index, occupied, 1);
+      putFloat(index, stair);
+      stored.insert(tile.key);
+    }
+    std::vector<char> leaf_records;
+    leaf_records.reserve(leaves.size() * leaf_record_size);
+    for (size_t l=0; l<leaves.size(); l++) {
+      appendLeafRecord(leaf_records, leaves[l].key, leaves[l].depth, leaves[l].node);
+    }
+    index.write(leaf_records.data(), leaf_records.size());
+    if (!ok)
+      return false;
+
+    const std::string name = tiles.directory + "/index";
+    std::ofstream file((name + ".tmp").c_str(), std::ios_base::out | std::ios_base::binary);
+    const std::string data = index.str();
+    file.write(data.data(), data.size());
+    file.close();
+    if (!file.good() || std::rename((name + ".tmp").c_str(), name.c_str()) != 0) {
+      OCTOMAP_ERROR_STR("Could not write tile index " << name << ".");
+      return false;
+    }
+
+    // Tiles that were pruned or deleted since the last save
+    for (KeySet::const_iterator it = tiles.stored.begin(); it != tiles.stored.end(); ++it) {
+      if (!stored.count(*it))
+        std::remove(tileFileName(*it).c_str());
+    }
+    tiles.stored.swap(stored);
+    tiles.dirty.clear();
+    return true;
+  }
+
+  bool RoughOcTree::openTileStore(const std::string& directory) {
+    // tree needs to be newly created or cleared externally
+    if (this->root) {
+      OCTOMAP_ERROR_STR("Trying to read into an existing tree.");
+      return false;
+    }
+
+    const std::string name = directory + "/index";
+    std::ifstream file(name.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!file.is_open()) {
+      OCTOMAP_ERROR_STR("Filestream to " << name << " not open, nothing read.");
+      return false;
+    }
+    std::vector<char> buf;
+    readRemaining(file, buf);
+    if (buf.size() < tile_index_prefix || memcmp(buf.data(), tile_index_magic, sizeof(tile_index_magic)) != 0 ||
+        (unsigned char)buf[4] != tile_index_version) {
+      OCTOMAP_ERROR("Not a tile index (version %u).\n", tile_index_version);
+      return false;
+    }
+    const unsigned int depth = (unsigned char)buf[5];
+    const uint64_t num_tiles = getLittleEndian(&buf[6], 4);
+    const uint64_t num_leaves = getLittleEndian(&buf[10], 4);
+    if (depth == 0 || depth >= this->tree_depth ||
+        buf.size() != tile_index_prefix + num_tiles * tile_index_tile_size + num_leaves * leaf_record_size) {
+      OCTOMAP_ERROR("Invalid tile index (tile depth %u, %lu tiles, %lu leaves).\n", depth,
+                    (unsigned long)num_tiles, (unsigned long)num_leaves);
+      return false;
+    }
+
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+    file_subtrees = FileSubtrees();
+    tiles = TileStore();
+    tiles.active = true;
+    tiles.directory = directory;
+    tiles.depth = depth;
+
+    // Rebuild the nodes above the tiles from the keys, then the inner nodes from their children
+    const char* data = &buf[tile_index_prefix];
+    for (uint64_t t=0; t<num_tiles; t++, data += tile_index_tile_size) {
+      const OcTreeKey key = getRecordKey(data);
+      RoughOcTreeNode* node = createNodePath(key, depth);
+      if (node->children == NULL)
+        this->allocNodeChildren(node);
+      node->setLogOdds(data[6] ? this->clamping_thres_max : this->clamping_thres_min);
+      node->setStairLogOdds(getFloat(data + 7));
+      tiles.unloaded.insert(key);
+      tiles.stored.insert(key);
+    }
+    for (uint64_t l=0; l<num_leaves; l++, data += leaf_record_size) {
+      getLeafRecord(data, createNodePath(getRecordKey(data), (unsigned char)data[6]));
+    }
+    if (this->root)
+      updateInnerBinningRecurs(this->root, 0, depth);
+    this->size_changed = true;
+    return true;
+  }
+
+  uint64_t RoughOcTree::mortonCode(const OcTreeKey& key) const {
+    uint64_t code = 0;
+    for (unsigned int d=0; d<this->tree_depth; d++) {
+      code = (code << 3) | computeChildIdx(key, this->tree_depth - 1 - d);
+    }
+    return code;
+  }
+
+  bool RoughOcTree::buildFromSortedLeaves(const std::vector<RoughLeaf>& leaves, bool prune) {
+    // tree needs to be newly created or cleared externally
+    if (this->root) {
+      OCTOMAP_ERROR_STR("Trying to build into an existing tree.");
+      return false;
+    }
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+
+    BulkBuild build;
+    build.prune = prune;
+    bool ok = true;
+    for (size_t l=0; l<leaves.size(); l++) {
+      const RoughLeaf& leaf = leaves[l];
+      RoughOcTreeNode* node = addBulkLeaf(build, leaf.key, leaf.depth);
+      if (!node) {
+        ok = false;
+        break;
+      }
+      node->setLogOdds(leaf.log_odds);
+      node->setRough(leaf.rough);
+      node->setStairLogOdds(leaf.stair_log_odds);
+      node->setAgent(leaf.agent);
+    }
+    this->size_changed = true;
+    if (!ok) {
+      // a partial tree would be missing an arbitrary part of the map
+      this->clear();
+      return false;
+    }
+    if (build.started)
+      finishBulkNodes(build, 0);
+    return true;
+  }
+
+  RoughOcTreeNode* RoughOcTree::addBulkLeaf(BulkBuild& build, const OcTreeKey& key, unsigned int depth) {
+    if (depth > this->tree_depth) {
+      OCTOMAP_ERROR("Leaf depth %u is below the tree depth %u.\n", depth, this->tree_depth);
+      return NULL;
+    }
+    // The leaf covers the codes that share its path down to depth
+    const unsigned int shift = 3 * (this->tree_depth - depth);
+    const uint64_t first = (mortonCode(key) >> shift) << shift;
+    unsigned int shared = 0;
+    if (build.started) {
+      if (first <= build.last) {
+        OCTOMAP_ERROR("Leaves are out of order or overlap.\n");
+        return NULL;
+      }
+      // Deepest node on both paths: levels above the highest bit that differs
+      unsigned int bit = 63;
+      while (!((first ^ build.last) >> bit & 1)) bit--;
+      shared = (3 * this->tree_depth - 1 - bit) / 3;
+      finishBulkNodes(build, shared + 1);
+    }
+    else {
+      build.path.assign(this->tree_depth + 1, NULL);
+      this->root = new RoughOcTreeNode();
+      this->tree_size++;
+      build.path[0] = this->root;
+      build.started = true;
+    }
+
+    for (unsigned int d=shared; d<depth; d++) {
+      build.path[d+1] = this->createNodeChild(build.path[d], computeChildIdx(key, this->tree_depth - 1 - d));
+    }
+    build.depth = depth;
+    build.last = first + ((1ull << shift) - 1);
+    return build.path[depth];
+  }
+
+  void RoughOcTree::finishBulkNodes(BulkBuild& build, unsigned int depth) {
+    // the leaf itself is done
+    for (unsigned int d=build.depth; d-- > depth; ) {
+      RoughOcTreeNode* node = build.path[d];
+      node->setLogOdds(node->getMaxChildLogOdds());
+      node->updateRoughChildren();
+      node->setStairLogOdds(node->getMaxChildStairLogOdds());
+      if (build.prune)
+        pruneNode(node);
+    }
+  }
+
+  std::ostream& RoughOcTree::writeOccupiedPoints(std::ostream &s, RoughPointFormat format) {
+    if (!materializeAll()) {
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    // The header states the number of points. Seekable streams get a zero-padded count that is
+    // filled in after the traversal; others need a counting pass first.
+    const std::streampos header_pos = s.tellp();
+    const bool patch_count = header_pos != std::streampos(-1);
+    uint64_t num_points = 0;
+    if (!patch_count) {
+      const std::vector<DepthCounts>& counts = getDepthCounts();
+      for (size_t d=0; d<counts.size(); d++) {
+        num_points += counts[d].leafs_occupied;
+      }
+    }
+    s << pointCloudHeader(format, num_points, patch_count);
+
+    std::atomic<uint64_t> written(0);
+    const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+    const unsigned int threads = binary_encoding_threads ? binary_encoding_threads : std::thread::hardware_concurrency();
+    if (!this->root) {
+      // nothing to write
+    }
+    else if (threads <= 1 || binary_split_depth == 0 || binary_split_depth >= this->tree_depth) {
+      PointBuffer out = { &s, NULL, std::vector<char>(), 0 };
+      out.data.reserve(point_buffer_size);
+      writePointsRecurs(out, this->root, 0, root_key, NULL, 0);
+      out.flush();
+      written = out.count;
+    }
+    else {
+      // The leaves above the split go out first, then the subtrees from a buffer per thread
+      std::mutex lock;
+      std::vector<std::pair<OcTreeKey, const RoughOcTreeNode*> > subtrees;
+      PointBuffer top = { &s, &lock, std::vector<char>(), 0 };
+      writePointsRecurs(top, this->root, 0, root_key, &subtrees, binary_split_depth);
+      top.flush();
+      written = top.count;
+
+      std::atomic<size_t> next_job(0);
+      auto worker = [&]() {
+        PointBuffer out = { &s, &lock, std::vector<char>(), 0 };
+        out.data.reserve(point_buffer_size);
+        for (size_t j = next_job++; j < subtrees.size(); j = next_job++) {
+          writePointsRecurs(out, subtrees[j].second, binary_split_depth, subtrees[j].first, NULL, 0);
+        }
+        out.flush();
+        written += out.count;
+      };
+      std::vector<std::thread> pool;
+      for (unsigned int t=1; t<threads && t<subtrees.size(); t++) {
+        pool.emplace_back(worker);
+      }
+      worker();
+      for (size_t t=0; t<pool.size(); t++) {
+        pool[t].join();
+      }
+    }
+
+    if (patch_count && s.good()) {
+      const std::streampos end_pos = s.tellp();
+      s.seekp(header_pos);
+      s << pointCloudHeader(format, written, true);
+      s.seekp(end_pos);
+    }
+    return s;
+  }
+
+  bool RoughOcTree::writeOccupiedPoints(const std::string& filename, RoughPointFormat format) {
+    std::ofstream file(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!file.is_open()) {
+      OCTOMAP_ERROR_STR("Filestream to " << filename << " not open, nothing written.");
+      return false;
+    }
+    writeOccupiedPoints(file, format);
+    file.close();
+    return file.good();
+  }
+
+  void RoughOcTree::PointBuffer::flush() {
+    if (data.empty())
+      return;
+    if (lock) {
+      std::lock_guard<std::mutex> guard(*lock);
+      s->write(data.data(), data.size());
+    }
+    else {
+      s->write(data.data(), data.size());
+    }
+    data.clear();
+  }
+
+  void RoughOcTree::writePointsRecurs(PointBuffer& out, const RoughOcTreeNode* node, unsigned int depth, const OcTreeKey& key,
+                                      std::vector<std::pair<OcTreeKey, const RoughOcTreeNode*> >* subtrees,
+                                      unsigned int split_depth) const {
+    if (!this->nodeHasChildren(node)) {
+      if (!this->isNodeOccupied(node))
+        return;
+      const point3d center = this->keyToCoord(key, depth);
+      const size_t pos = out.data.size();
+      out.data.resize(pos + point_record_size);
+      char* record = &out.data[pos];
+      storeFloat(record, center.x());
+      storeFloat(record + 4, center.y());
+      storeFloat(record + 8, center.z());
+      storeFloat(record + 12, this->getNodeSize(depth));
+      storeFloat(record + 16, node->getRough());
+      storeFloat(record + 20, node->getStairProbability());
+      record[24] = node->getAgent();
+      out.count++;
+      if (out.data.size() + point_record_size > point_buffer_size)
+        out.flush();
+      return;
+    }
+    if (subtrees && depth == split_depth) {
+      subtrees->push_back(std::make_pair(key, node));
+      return;
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth+1), key, child_key);
+      writePointsRecurs(out, this->getNodeChild(node, i), depth+1, child_key, subtrees, split_depth);
+    }
+  }
+
+  RoughOcTreeNode* RoughOcTree::createNodePath(const OcTreeKey& key, unsigned int depth) {
+    if (!this->root) {
+      this->root = new RoughOcTreeNode();
+      this->tree_size++;
+    }
+    RoughOcTreeNode* node = this->root;
+    for (unsigned int d=0; d<depth; d++) {
+      const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+      node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : this->createNodeChild(node, pos);
+    }
+    return node;
+  }
+
+  bool RoughOcTree::loadTile(const OcTreeKey& key) {
+    const OcTreeKey tile_key = hashKey(key, tiles.depth);
+    if (!tiles.unloaded.count(tile_key))
+      return true;
+    tiles.unloaded.erase(tile_key);
+    RoughOcTreeNode* node = fileSubtreeNode(key, tiles.depth);
+    if (!node)
+      return true;
+
+    const std::string name = tileFileName(tile_key);
+    std::ifstream file(name.c_str(), std::ios_base::in | std::ios_base::binary);
+    BinaryHeader header;
+    if (!file.is_open() || !readBinaryHeader(file, header)) {
+      OCTOMAP_ERROR_STR("Could not read tile " << name << ".");
+      return false;
+    }
+    std::vector<char> buf;
+    readRemaining(file, buf);
+
+    // Each tile carries the bins and stair bits it was written with
+    uint rough_bits, stair_bits;
+    std::vector<float> rough_lut, stair_lut;
+    binaryHeaderLuts(header, rough_bits, stair_bits, rough_lut, stair_lut);
+    if (header.mode != BINNING || rough_bits > 8) {
+      OCTOMAP_ERROR_STR("Tile " << name << " is not a binning stream.");
+      return false;
+    }
+    const char* end = buf.data() + buf.size();
+    bool ok = true;
+    countDepthNode(node, tiles.depth, -1);
+    if (decodeBinningStream(buf.data(), end, node, this->tree_size, NULL, rough_bits, stair_bits,
+                            rough_lut.data(), stair_lut.data()) != end) {
+      OCTOMAP_ERROR_STR("Tile " << name << " is corrupt.");
+      ok = false;
+    }
+    if (this->nodeHasChildren(node)) {
+      node->setLogOdds(node->getMaxChildLogOdds());
+      node->setStairLogOdds(node->getMaxChildStairLogOdds());
+    }
+    countDepthSubtreeRecurs(node, tiles.depth, 1);
+    this->size_changed = true;
+    markHashDirty(key);
+    return ok;
+  }
+
+  bool RoughOcTree::unloadTile(const OcTreeKey& key) {
+    if (!tiles.active)
+      return false;
+    const OcTreeKey tile_key = hashKey(key, tiles.depth);
+    RoughOcTreeNode* node = this->root;
+    for (unsigned int d=0; node && d<tiles.depth; d++) {
+      const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+      node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : NULL;
+    }
+    // Nothing loaded there
+    if (!node || !this->nodeHasChildren(node))
+      return true;
+
+    if ((tiles.dirty.count(tile_key) || !tiles.stored.count(tile_key)) && !writeTile(tile_key, node))
+      return false;
+    tiles.dirty.erase(tile_key);
+
+    bool occupied = false;
+    float stair = -std::numeric_limits<float>::max();
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    fileSubtreeSummaryRecurs(node, this->stairsEnabled ? stair_lut.data() : NULL, occupied, stair);
+    countDepthSubtreeRecurs(node, tiles.depth, -1);
+    deleteNodeChildrenRecurs(node);
+    this->allocNodeChildren(node);
+    node->setLogOdds(occupied ? this->clamping_thres_max : this->clamping_thres_min);
+    node->setStairLogOdds(stair);
+    countDepthNode(node, tiles.depth, 1);
+    tiles.unloaded.insert(tile_key);
+    tiles.stored.insert(tile_key);
+    this->size_changed = true;
+    markHashDirty(key);
+    return true;
+  }
+
+  bool RoughOcTree::setTileWorkingArea(const point3d& center, double radius) {
+    if (!tiles.active || !this->root)
+      return tiles.active;
+    std::vector<TileNode> tile_nodes, leaves;
+    const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+    collectTilesRecurs(this->root, 0, root_key, tile_nodes, leaves);
+
+    const double half = this->getNodeSize(tiles.depth) / 2;
+    bool ok = true;
+    for (size_t t=0; t<tile_nodes.size(); t++) {
+      // Distance from center to the tile's box
+      const point3d c = this->keyToCoord(tile_nodes[t].key, tiles.depth);
+      double d2 = 0;
+      for (unsigned int a=0; a<3; a++) {
+        const double d = std::max(0.0, std::fabs((double)center(a) - c(a)) - half);
+        d2 += d * d;
+      }
+      if (d2 <= radius * radius)
+        ok = loadTile(tile_nodes[t].key) && ok;
+      else
+        ok = unloadTile(tile_nodes[t].key) && ok;
+    }
+    return ok;
+  }
+
+  bool RoughOcTree::openJournal(const std::string& base) {
+    if (journal.fd >= 0) {
+      OCTOMAP_ERROR("A journal is already open.\n");
+      return false;
+    }
+    const bool kept = fileExists(base + ".checkpoint") || fileExists(journalSegmentName(base, 1));
+    if (kept && this->root) {
+      OCTOMAP_ERROR_STR("Trying to recover " << base << " into an existing tree.");
+      return false;
+    }
+
+    uint64_t segment = 0;
+    if (kept) {
+      if (!readJournalCheckpoint(base, segment))
+        return false;
+      // Segments in the checkpoint that a compaction did not get to remove
+      for (uint64_t n = segment; n > 0 && std::remove(journalSegmentName(base, n).c_str()) == 0; n--);
+      while (fileExists(journalSegmentName(base, segment + 1))) {
+        segment++;
+        if (!replayJournalSegment(journalSegmentName(base, segment)))
+          return false;
+      }
+    }
+    else if (!writeJournalCheckpoint(base, 0)) {
+      return false;
+    }
+
+    journal.base = base;
+    journal.batch.reserve(journal_batch_size + journal_batch_prefix + leaf_record_size);
+    return openJournalSegment(segment + 1);
+  }
+
+  bool RoughOcTree::readJournalCheckpoint(const std::string& base, uint64_t& segment) {
+    segment = 0;
+    const std::string name = base + ".checkpoint";
+    std::ifstream file(name.c_str(), std::ios_base::in | std::ios_base::binary);
+    // Only segments so far
+    if (!file.is_open())
+      return true;
+    std::vector<char> buf;
+    readRemaining(file, buf);
+    if (buf.size() < checkpoint_prefix || memcmp(buf.data(), checkpoint_magic, sizeof(checkpoint_magic)) != 0 ||
+        (unsigned char)buf[4] != journal_version) {
+      OCTOMAP_ERROR("Not a journal checkpoint (version %u).\n", journal_version);
+      return false;
+    }
+    segment = getLittleEndian(&buf[5], 8);
+    const uint64_t num_leaves = getLittleEndian(&buf[13], 8);
+    if (buf.size() != checkpoint_prefix + num_leaves * leaf_record_size) {
+      OCTOMAP_ERROR_STR("Journal checkpoint " << name << " is truncated.");
+      return false;
+    }
+    // Written depth first, as they were pruned
+    invalidateDepthCounts();
+    BulkBuild build;
+    build.prune = false;
+    const char* data = &buf[checkpoint_prefix];
+    for (uint64_t l=0; l<num_leaves; l++, data += leaf_record_size) {
+      RoughOcTreeNode* node = addBulkLeaf(build, getRecordKey(data), (unsigned char)data[6]);
+      if (!node) {
+        OCTOMAP_ERROR_STR("Journal checkpoint " << name << " is corrupt.");
+        this->clear();
+        return false;
+      }
+      getLeafRecord(data, node);
+    }
+    if (build.started)
+      finishBulkNodes(build, 0);
+    this->size_changed = true;
+    return true;
+  }
+
+  bool RoughOcTree::writeJournalCheckpoint(const std::string& base, uint64_t segment) const {
+    std::vector<char> data(checkpoint_prefix);
+    memcpy(data.data(), checkpoint_magic, sizeof(checkpoint_magic));
+    data[4] = (char)journal_version;
+    for (uint i=0; i<8; i++) data[5 + i] = (char)(segment >> (8 * i));
+    if (this->root) {
+      data.reserve(checkpoint_prefix + this->tree_size * leaf_record_size);
+      const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+      appendLeafRecordsRecurs(data, this->root, 0, root_key);
+    }
+    const uint64_t num_leaves = (data.size() - checkpoint_prefix) / leaf_record_size;
+    for (uint i=0; i<8; i++) data[13 + i] = (char)(num_leaves >> (8 * i));
+
+    // Replaces the old checkpoint only once it is on disk
+    const std::string name = base + ".checkpoint";
+    const int fd = ::open((name + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writeAll(fd, data.data(), data.size()) && ::fsync(fd) == 0;
+    if (fd >= 0)
+      ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename((name + ".tmp").c_str(), name.c_str()) != 0) {
+      OCTOMAP_ERROR_STR("Could not write journal checkpoint " << name << ".");
+      return false;
+    }
+    for (uint64_t n = segment; n > 0 && std::remove(journalSegmentName(base, n).c_str()) == 0; n--);
+    return true;
+  }
+
+  bool RoughOcTree::openJournalSegment(uint64_t segment) {
+    const std::string name = journalSegmentName(journal.base, segment);
+    const int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    char prefix[journal_prefix];
+    memcpy(prefix, journal_magic, sizeof(journal_magic));
+    prefix[4] = (char)journal_version;
+    if (fd < 0 || !writeAll(fd, prefix, journal_prefix)) {
+      OCTOMAP_ERROR_STR("Could not create journal segment " << name << ".");
+      if (fd >= 0) ::close(fd);
+      return false;
+    }
+    if (journal.fd >= 0)
+      ::close(journal.fd);
+    journal.fd = fd;
+    journal.segment = segment;
+    return true;
+  }
+
+  bool RoughOcTree::replayJournalSegment(const std::string& name) {
+    std::ifstream file(name.c_str(), std::ios_base::in | std::ios_base::binary);
+    std::vector<char> buf;
+    readRemaining(file, buf);
+    if (buf.size() < journal_prefix || memcmp(buf.data(), journal_magic, sizeof(journal_magic)) != 0 ||
+        (unsigned char)buf[4] != journal_version) {
+      OCTOMAP_ERROR_STR("Not a journal segment (version " << journal_version << "): " << name);
+      return false;
+    }
+
+    const char* data = buf.data() + journal_prefix;
+    const char* end = buf.data() + buf.size();
+    while (data < end) {
+      // A crash while writing leaves the last batch short or with a wrong checksum
+      const uint64_t length = (size_t)(end - data) >= journal_batch_prefix ? getLittleEndian(data, 4) : 0;
+      if ((size_t)(end - data) < journal_batch_prefix || length > (uint64_t)(end - data - journal_batch_prefix) ||
+          journalChecksum(data + journal_batch_prefix, length) != getLittleEndian(data + 4, 4)) {
+        OCTOMAP_WARNING_STR("Journal segment " << name << " ends in an incomplete batch, dropping it.");
+        break;
+      }
+      const char* record = data + journal_batch_prefix;
+      const char* batch_end = record + length;
+      while (record < batch_end) {
+        const unsigned int fields = (batch_end - record >= 7) ? (unsigned char)record[6] : 0;
+        const size_t size = 7 + 4 * (((fields & JOURNAL_OCCUPANCY) != 0) + ((fields & JOURNAL_STAIR_UPDATE) != 0) +
+                                     ((fields & JOURNAL_ROUGH) != 0) + ((fields & JOURNAL_STAIRS) != 0)) +
+                            ((fields & JOURNAL_AGENT) != 0);
+        if ((size_t)(batch_end - record) < size) {
+          OCTOMAP_ERROR_STR("Journal segment " << name << " is corrupt.");
+          return false;
+        }
+        const OcTreeKey key = getRecordKey(record);
+        record += 7;
+        if (fields & JOURNAL_OCCUPANCY) {
+          updateNode(key, getFloat(record));
+          record += 4;
+        }
+        if (fields & JOURNAL_STAIR_UPDATE) {
+          updateNodeStairs(key, getFloat(record));
+          record += 4;
+        }
+        if (fields & JOURNAL_ROUGH) {
+          setNodeRough(key, getFloat(record));
+          record += 4;
+        }
+        if (fields & JOURNAL_STAIRS) {
+          setNodeStairLogOdds(key, getFloat(record));
+          record += 4;
+        }
+        if (fields & JOURNAL_AGENT) {
+          setNodeAgent(key, *record);
+          record += 1;
+        }
+      }
+      data = batch_end;
+    }
+    return true;
+  }
+
+  void RoughOcTree::appendJournalRecord(const OcTreeKey& key, unsigned int fields, float delta, const RoughOcTreeNode* node) {
+    std::vector<char>& batch = journal.batch;
+    // room for the length and checksum
+    if (batch.empty())
+      batch.resize(journal_batch_prefix);
+    for (unsigned int a=0; a<3; a++) appendLittleEndian(batch, key[a], 2);
+    batch.push_back((char)fields);
+    if (fields & (JOURNAL_OCCUPANCY | JOURNAL_STAIR_UPDATE)) appendFloat(batch, delta);
+    if (fields & JOURNAL_ROUGH) appendFloat(batch, node->getRough());
+    if (fields & JOURNAL_STAIRS) appendFloat(batch, node->getStairLogOdds());
+    if (fields & JOURNAL_AGENT) batch.push_back(node->getAgent());
+    if (batch.size() >= journal_batch_size)
+      flushJournal();
+  }
+
+  bool RoughOcTree::flushJournal() {
+    if (journal.fd < 0) {
+      OCTOMAP_ERROR("No journal open.\n");
+      return false;
+    }
+    std::vector<char>& batch = journal.batch;
+    if (batch.size() <= journal_batch_prefix)
+      return true;
+
+    const uint64_t length = batch.size() - journal_batch_prefix;
+    const uint32_t checksum = journalChecksum(&batch[journal_batch_prefix], length);
+    for (uint i=0; i<4; i++) {
+      batch[i] = (char)(length >> (8 * i));
+      batch[4 + i] = (char)(checksum >> (8 * i));
+    }
+    const bool ok = writeAll(journal.fd, batch.data(), batch.size()) && (!journal_sync || ::fdatasync(journal.fd) == 0);
+    batch.clear();
+    if (!ok)
+      OCTOMAP_ERROR_STR("Could not write to journal segment " << journalSegmentName(journal.base, journal.segment) << ".");
+    return ok;
+  }
+
+  bool RoughOcTree::compactJournal(bool background) {
+    if (journal.fd < 0) {
+      OCTOMAP_ERROR("No journal open.\n");
+      return false;
+    }
+    // One at a time; the segments of a failed one are folded into the next
+    waitForCompaction();
+    if (!flushJournal())
+      return false;
+    const uint64_t segment = journal.segment;
+    if (!openJournalSegment(segment + 1))
+      return false;
+
+    // The segments are replayed onto the last checkpoint in a scratch tree, so the map itself
+    // is not traversed or locked. The scratch tree needs the clamping the updates were made with.
+    std::shared_ptr<RoughOcTree> scratch(new RoughOcTree(this->resolution));
+    scratch->clamping_thres_min = this->clamping_thres_min;
+    scratch->clamping_thres_max = this->clamping_thres_max;
+    scratch->occ_prob_thres_log = this->occ_prob_thres_log;
+    scratch->stairs_clamping_thres_min = this->stairs_clamping_thres_min;
+    scratch->stairs_clamping_thres_max = this->stairs_clamping_thres_max;
+    scratch->stairs_prob_thres_log = this->stairs_prob_thres_log;
+    const std::string base = journal.base;
+    auto fold = [scratch, base, segment]() {
+      uint64_t n = 0;
+      if (!scratch->readJournalCheckpoint(base, n))
+        return false;
+      while (n < segment) {
+        if (!scratch->replayJournalSegment(journalSegmentName(base, ++n)))
+          return false;
+      }
+      return scratch->writeJournalCheckpoint(base, segment);
+    };
+    if (!background)
+      return fold();
+    journal.compaction = std::async(std::launch::async, fold);
+    return true;
+  }
+
+  void RoughOcTree::appendLeafRecordsRecurs(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int depth,
+                                            const OcTreeKey& key) const {
+    if (!this->nodeHasChildren(node)) {
+      appendLeafRecord(buf, key, depth, node);
+      return;
+    }
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth+1), key, child_key);
+      appendLeafRecordsRecurs(buf, this->getNodeChild(node, i), depth+1, child_key);
+    }
+  }
+
+  bool RoughOcTree::waitForCompaction() {
+    if (!journal.compaction.valid())
+      return true;
+    return journal.compaction.get();
+  }
+
+  bool RoughOcTree::closeJournal() {
+    if (journal.fd < 0)
+      return waitForCompaction();
+    bool ok = flushJournal();
+    ok = waitForCompaction() && ok;
+    ::close(journal.fd);
+    journal.fd = -1;
+    journal.batch.clear();
+    return ok;
+  }
+
+  std::istream& RoughOcTree::readBinaryNode(std::istream &s, RoughOcTreeNode* node) {
+    switch (binary_encoding_mode) {
+      case THRESHOLDING:
+        // printf("Reading binary node via thresholding.\n");
+        return readBinaryNodeViaThresholding(s, node);
+        break;
+      case BINNING:
+        // printf("Reading binary node via binning.\n");
+        return readBinaryNodeViaBinning(s, node);
+        break;
+      case VARIABLE_BINNING:
+        return readBinaryNodeViaVariableBinning(s, node);
+        break;
+      case ARITHMETIC_CODING:
+        return readBinaryNodeViaArithmeticCoding(s, node);
+        break;
+      case PROGRESSIVE_BINNING:
+        return readBinaryNodeViaProgressiveBinning(s, node);
+        break;
+      default:
+        OCTOMAP_ERROR("Invalid binary encoding mode.");
+        return s;
+    }
+  }
+
+  std::ostream& RoughOcTree::writeBinaryNode(std::ostream &s, const RoughOcTreeNode* node) {
+    switch (binary_encoding_mode) {
+      case THRESHOLDING:
+        // printf("Writing binary node via thresholding.\n");
+        return writeBinaryNodeViaThresholding(s, node);
+        break;
+      case BINNING:
+        // printf("Writing binary node via binning.\n");
+        return writeBinaryNodeViaBinning(s, node);
+        break;
+      case VARIABLE_BINNING:
+        return writeBinaryNodeViaVariableBinning(s, node);
+        break;
+      case ARITHMETIC_CODING:
+        return writeBinaryNodeViaArithmeticCoding(s, node);
+        break;
+      case PROGRESSIVE_BINNING:
+        return writeBinaryNodeViaProgressiveBinning(s, node);
+        break;
+      default:
+        OCTOMAP_ERROR("Invalid binary encoding mode.");
+        return s;
+    }
+  }
+
+  std::istream& RoughOcTree::readBinaryNodeViaThresholding(std::istream &s, RoughOcTreeNode* node){
+
+    assert(node);
+
+    std::vector<char> buf;
+    readRemaining(s, buf, binary_inner_nodes_follow * 3);
+    const char* end = buf.data() + buf.size();
+    const char* pos = decodeThresholdingLoop(buf.data(), end, node, this->tree_size);
+    if (!pos) {
+      OCTOMAP_ERROR("Binary stream ended before the tree was complete.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    unreadRemaining(s, end - pos);
+    return s;
+  }
+
+  const char* RoughOcTree::decodeThresholdingLoop(const char* data, const char* end, RoughOcTreeNode* node,
+                                                  size_t& num_nodes) {
+
+    // Explicit pre-order stack: one frame per inner node on the path to the current record,
+    // listing the inner children still to be read
+    struct Frame {
+      RoughOcTreeNode* node;
+      unsigned char inner_children[8];
+      unsigned char num_inner_children;
+      unsigned char next;
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+
+    RoughOcTreeNode* pending = node;
+    for (;;) {
+      if (pending) {
+        if (top == (int)max_codec_depth || end - data < 3) return NULL;
+        Frame& f = stack[++top];
+        f.node = pending;
+        f.num_inner_children = 0;
+        f.next = 0;
+        pending = NULL;
+
+        // 3 bits per child, LSB first: 10* free, 01* occupied, 11* inner, 00* unknown, **1 rough
+        const uint32_t bits = (uint32_t)(unsigned char)data[0] | (uint32_t)(unsigned char)data[1] << 8
+                              | (uint32_t)(unsigned char)data[2] << 16;
+        data += 3;
+
+        // inner nodes default to occupied
+        f.node->setLogOdds(this->clamping_thres_max);
+        for (unsigned int i=0; i<8; i++) {
+          const uint32_t child_bits = bits >> (3*i);
+          switch (child_bits & 3) {
+            case 1: // child is free leaf
+              allocNodeChild(f.node, i, num_nodes)->setLogOdds(this->clamping_thres_min);
+              break;
+            case 2: { // child is occupied leaf
+              RoughOcTreeNode* child = allocNodeChild(f.node, i, num_nodes);
+              child->setLogOdds(this->clamping_thres_max);
+              // rough children get the binary threshold, the rest zero
+              child->setRough((child_bits & 4) ? this->rough_binary_thres : 0.0f);
+              break;
+            }
+            case 3: // child has children
+              allocNodeChild(f.node, i, num_nodes);
+              f.inner_children[f.num_inner_children++] = i;
+              break;
+            default: // child is unknown
+              break;
+          }
+        }
+      }
+
+      Frame& f = stack[top];
+      if (f.next < f.num_inner_children) {
+        pending = this->getNodeChild(f.node, f.inner_children[f.next++]);
+        continue;
+      }
+      // all children read, set the label
+      if (top == 0) break;
+      f.node->setLogOdds(f.node->getMaxChildLogOdds());
+      top--;
+    }
+
+    return data;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryNodeViaThresholding(std::ostream &s, const RoughOcTreeNode* node) {
+
+    assert(node);
+
+    std::vector<char> buf;
+    buf.reserve((this->tree_size / 8 + 1) * 3);
+    encodeThresholdingLoop(buf, node);
+    s.write(buf.data(), buf.size());
+    return s;
+  }
+
+  void RoughOcTree::encodeThresholdingLoop(std::vector<char>& buf, const RoughOcTreeNode* node) const {
+
+    // 3 bits for each children, 8 children per node -> 24 bits
+    // 10* : child is free node
+    // 01* : child is occupied node
+    // 00* : child is unkown node
+    // 11* : child has children
+    // **1 : child is rough
+    // **0 : child is traversable or traversability unknown (should be treated similarly)
+    struct Frame {
+      const RoughOcTreeNode* node;
+      unsigned int inner_children; // bit mask
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+    const unsigned int leaf_depth = binaryLeafDepth();
+
+    const RoughOcTreeNode* pending = node;
+    for (;;) {
+      if (pending) {
+        // children at the leaf depth are written as leaves, whatever is below them
+        const unsigned int depth = top + 1; // of pending, the stack holds its ancestors
+        const bool leaf_children = depth + 1 >= leaf_depth;
+        uint32_t bits = 0;
+        unsigned int inner_children = 0;
+        for (unsigned int i=0; i<8; i++) {
+          if (!this->nodeChildExists(pending, i)) continue;
+          const RoughOcTreeNode* child = this->getNodeChild(pending, i);
+          uint32_t child_bits;
+          if (!leaf_children && this->nodeHasChildren(child)) {
+            child_bits = 3;
+            inner_children |= 1u << i;
+          }
+          else if (this->isNodeOccupied(child)) {
+            child_bits = 2;
+            // fails if rough is nan or less than or equal to rough binary threshold
+            if (encodedRough(child) > this->rough_binary_thres) child_bits |= 4;
+          }
+          else child_bits = 1;
+          bits |= child_bits << (3*i);
+        }
+        buf.push_back((char)bits);
+        buf.push_back((char)(bits >> 8));
+        buf.push_back((char)(bits >> 16));
+
+        stack[++top].node = pending;
+        stack[top].inner_children = inner_children;
+        pending = NULL;
+      }
+
+      // write children's children
+      Frame& f = stack[top];
+      if (f.inner_children) {
+        unsigned int i = 0;
+        while (!((f.inner_children >> i) & 1)) i++;
+        f.inner_children &= f.inner_children - 1;
+        pending = this->getNodeChild(f.node, i);
+        continue;
+      }
+      if (top-- == 0) break;
+    }
+  }
+
+  std::istream& RoughOcTree::readBinaryNodeViaBinning(std::istream &s, RoughOcTreeNode* node,
+                                                      const OcTreeKey* bbx_min, const OcTreeKey* bbx_max){
+
+    assert(node);
+
+    std::vector<char> buf;
+    readRemaining(s, buf, binary_inner_nodes_follow * num_bits_per_node);
+
+    const char* end = buf.data() + buf.size();
+    BinarySubtreeIndex index;
+    if (!binary_index_follows) {
+      const char* pos = decodeBinaryNodeViaBinning(buf.data(), end, node, this->tree_size);
+      if (!pos) {
+        OCTOMAP_ERROR("Binary stream ended before the tree was complete.\n");
+        s.setstate(std::ios_base::failbit);
+        return s;
+      }
+      unreadRemaining(s, end - pos);
+      return s;
+    }
+
+    // Indexed stream: decode the records above the split depth, then the subtrees below it
+    // on their own, in parallel. The index sits at the very end, so nothing follows the tree.
+    if (!readSubtreeIndex(buf.data(), end, index.depth, index.lengths)) {
+      OCTOMAP_ERROR("Binary header announces a subtree index, but the stream has no valid one.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    if (index.depth >= this->tree_depth) {
+      OCTOMAP_ERROR("Invalid subtree index split depth %u.\n", index.depth);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    index.bbx_min = bbx_min;
+    index.bbx_max = bbx_max;
+    index.jobs.reserve(index.lengths.size());
+    if (decodeBinaryNodeViaBinning(buf.data(), end, node, this->tree_size, &index) != end) {
+      OCTOMAP_ERROR("Binary stream does not match its subtree index.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    const unsigned int threads = binary_encoding_threads ? binary_encoding_threads : std::thread::hardware_concurrency();
+    std::atomic<size_t> next_job(0);
+    std::atomic<size_t> decoded(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+      size_t num_nodes = 0;
+      for (size_t j = next_job++; j < index.jobs.size(); j = next_job++) {
+        const BinarySubtreeJob& job = index.jobs[j];
+        if (decodeBinaryNodeViaBinning(job.data, job.data + job.length, job.node, num_nodes) != job.data + job.length) {
+          failed = true;
+          continue;
+        }
+        job.node->setLogOdds(job.node->getMaxChildLogOdds());
+        job.node->setStairLogOdds(job.node->getMaxChildStairLogOdds());
+      }
+      decoded += num_nodes;
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int t=1; t<threads && t<index.jobs.size(); t++) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for (size_t t=0; t<pool.size(); t++) {
+      pool[t].join();
+    }
+    this->tree_size += decoded;
+
+    if (failed) {
+      OCTOMAP_ERROR("Binary stream does not match its subtree index.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
     }
 
-    // read children's children and set the label
     for (unsigned int i=0; i<8; i++) {
-      if (this->nodeChildExists(node, i)) {
-        RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if (fabs(child->getLogOdds() + 200.)<1e-3) { // has children?
-          readBinaryNode(s, child);
-          child->setLogOdds(child->getMaxChildLogOdds());
-          child->setStairLogOdds(child->getMaxChildStairLogOdds());
+      if (this->nodeChildExists(node, i))
+        updateInnerBinningRecurs(this->getNodeChild(node, i), 1, index.depth);
+    }
+
+    return s;
+  }
+
+  std::istream& RoughOcTree::readBinaryDataBBX(std::istream &s, const point3d& bbx_min, const point3d& bbx_max) {
+    // tree needs to be newly created or cleared externally
+    if (this->root) {
+      OCTOMAP_ERROR_STR("Trying to read into an existing tree.");
+      return s;
+    }
+
+    OcTreeKey key_min, key_max;
+    if (!this->coordToKeyChecked(bbx_min, key_min) || !this->coordToKeyChecked(bbx_max, key_max)) {
+      OCTOMAP_ERROR_STR("Bounding box is outside of the tree.");
+      return s;
+    }
+
+    clearSubtreeHashes();
+    invalidateDepthCounts();
+    file_subtrees = FileSubtrees();
+    tiles = TileStore();
+    BinaryHeader header;
+    const bool has_header = readBinaryHeader(s, header);
+    if (!s)
+      return s;
+    binary_index_follows = has_header && header.subtree_index;
+    binary_inner_nodes_follow = has_header ? header.num_nodes - header.num_leafs : 0;
+    if (has_header) {
+      applyBinaryHeader(header);
+      if (header.num_nodes == 0)
+        return s;
+    }
+
+    if (binary_encoding_mode != BINNING) {
+      OCTOMAP_WARNING("Only binning streams can be decoded by region, reading the whole tree.\n");
+      return readBinaryData(s);
+    }
+
+    this->root = new RoughOcTreeNode();
+    this->tree_size = 1;
+    readBinaryNodeViaBinning(s, this->root, &key_min, &key_max);
+    if (!this->nodeHasChildren(this->root)) {
+      // nothing in the box
+      delete this->root;
+      this->root = NULL;
+      this->tree_size = 0;
+    }
+    this->size_changed = true;
+    return s;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryDataBBX(std::ostream &s, const point3d& bbx_min, const point3d& bbx_max) {
+    OcTreeKey key_min, key_max;
+    if (!this->coordToKeyChecked(bbx_min, key_min) || !this->coordToKeyChecked(bbx_max, key_max)) {
+      OCTOMAP_ERROR_STR("Bounding box is outside of the tree.");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    BinaryFilter filter;
+    filter.bbx_min = &key_min;
+    filter.bbx_max = &key_max;
+    return writeFilteredBinaryData(s, filter);
+  }
+
+  std::ostream& RoughOcTree::writeBinaryDataAgents(std::ostream &s, const std::vector<char>& agents) {
+    std::bitset<256> agent_set;
+    for (size_t i=0; i<agents.size(); i++) {
+      agent_set.set((unsigned char)agents[i]);
+    }
+    BinaryFilter filter;
+    filter.agents = &agent_set;
+    return writeFilteredBinaryData(s, filter);
+  }
+
+  std::ostream& RoughOcTree::writeFilteredBinaryData(std::ostream &s, const BinaryFilter& filter) {
+    if (binary_encoding_mode != BINNING) {
+      OCTOMAP_ERROR("Only binning streams can be filtered.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    if (!materializeAll()) {
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    // Serial, since a filter rarely leaves enough of the split subtrees to be worth the workers
+    std::vector<char> buf;
+    if (this->root) {
+      buf.reserve((this->tree_size / 8 + 1) * num_bits_per_node);
+      encodeBinaryNodeViaBinning(buf, this->root, 0, NULL, 0, &filter);
+    }
+    if (binaryHeaderEnabled()) {
+      uint64_t num_nodes, num_leafs;
+      countBinningRecords(buf, num_bits_per_node, num_nodes, num_leafs);
+      writeBinaryHeader(s, num_nodes, num_leafs);
+    }
+    s.write(buf.data(), buf.size());
+    return s;
+  }
+
+  uint64_t RoughOcTree::commitChanges() {
+    if (this->changed_keys.empty())
+      return change_version;
+    change_version++;
+    for (KeyBoolMap::const_iterator it = this->changed_keys.begin(); it != this->changed_keys.end(); ++it) {
+      change_versions[it->first] = change_version;
+    }
+    this->changed_keys.clear();
+    return change_version;
+  }
+
+  void RoughOcTree::resetChangeTracking() {
+    this->changed_keys.clear();
+    change_versions.clear();
+    forgotten_version = change_version;
+  }
+
+  void RoughOcTree::forgetChangesUpTo(uint64_t version) {
+    if (version <= forgotten_version)
+      return;
+    for (std::unordered_map<OcTreeKey, uint64_t, OcTreeKey::KeyHash>::iterator it = change_versions.begin();
+         it != change_versions.end(); ) {
+      if (it->second <= version) it = change_versions.erase(it);
+      else ++it;
+    }
+    forgotten_version = version;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryDelta(std::ostream &s, uint64_t since_version) {
+    commitChanges();
+    // The changes since then are no longer all known, so the receiver gets everything
+    if (since_version < forgotten_version)
+      return writeFilteredBinaryData(s, BinaryFilter());
+
+    // Mark the path down to the node holding every newer change; the encoder then only
+    // descends along marked nodes and writes the changed nodes as they are now
+    std::unordered_set<const RoughOcTreeNode*> nodes;
+    if (this->root) {
+      nodes.insert(this->root);
+      for (std::unordered_map<OcTreeKey, uint64_t, OcTreeKey::KeyHash>::const_iterator it = change_versions.begin();
+           it != change_versions.end(); ++it) {
+        if (it->second <= since_version) continue;
+        const RoughOcTreeNode* node = this->root;
+        for (int depth = (int)this->tree_depth - 1; depth >= 0 && this->nodeHasChildren(node); depth--) {
+          const unsigned int pos = computeChildIdx(it->first, depth);
+          if (!this->nodeChildExists(node, pos)) break;
+          node = this->getNodeChild(node, pos);
+          nodes.insert(node);
+        }
+      }
+    }
+
+    BinaryFilter filter;
+    filter.nodes = &nodes;
+    return writeFilteredBinaryData(s, filter);
+  }
+
+  void RoughOcTree::enableSubtreeHashes(bool enable) {
+    subtree_hashes_enabled = enable;
+    clearSubtreeHashes();
+  }
+
+  uint64_t RoughOcTree::getSubtreeHash(const OcTreeKey& key, unsigned int depth) {
+    // Pending subtrees would hash as the leaves standing in for them
+    if (hasFileSubtrees())
+      materializeNodeBox(key, depth);
+    const RoughOcTreeNode* node = findNode(key, depth);
+    if (!node)
+      return 0;
+    dropDirtySubtreeHashes();
+    return computeSubtreeHash(node, hashKey(key, depth), depth);
+  }
+
+  bool RoughOcTree::getChildHashes(const OcTreeKey& key, unsigned int depth, uint64_t child_hashes[8]) {
+    std::fill(child_hashes, child_hashes + 8, 0);
+    if (hasFileSubtrees())
+      materializeNodeBox(key, depth);
+    const RoughOcTreeNode* node = findNode(key, depth);
+    if (!node || !this->nodeHasChildren(node))
+      return false;
+    dropDirtySubtreeHashes();
+    const OcTreeKey node_key = hashKey(key, depth);
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth + 1), node_key, child_key);
+      child_hashes[i] = computeSubtreeHash(this->getNodeChild(node, i), child_key, depth + 1);
+    }
+    return true;
+  }
+
+  const RoughOcTreeNode* RoughOcTree::findNode(const OcTreeKey& key, unsigned int depth) const {
+    const RoughOcTreeNode* node = this->root;
+    for (unsigned int d=0; node && d<depth; d++) {
+      const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+      node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : NULL;
+    }
+    return node;
+  }
+
+  void RoughOcTree::dropDirtySubtreeHashes() {
+    if (!subtree_hashes_enabled) return;
+    for (KeySet::const_iterator it = dirty_hash_keys.begin(); it != dirty_hash_keys.end(); ++it) {
+      for (unsigned int depth=0; depth<this->tree_depth; depth++) {
+        subtree_hashes.erase(hashKey(*it, depth));
+      }
+    }
+    dirty_hash_keys.clear();
+  }
+
+  uint64_t RoughOcTree::leafHash(const RoughOcTreeNode* node) const {
+    // The leaf as binning writes it: free or occupied, and the rough bin and stair bits of
+    // occupied leaves
+    uint64_t v = 1;
+    if (this->isNodeOccupied(node)) {
+      v = 2;
+      if (num_rough_bits && node->isRoughSet())
+        v |= (((uint64_t)roughBin(node->getRough()) & ((1ull << num_rough_bits) - 1)) + 1) << 2;
+      if (stairsEnabled)
+        v |= stairBin(node, num_stair_bits) << 12;
+    }
+    if (subtree_hash_agent)
+      v |= (uint64_t)(unsigned char)node->getAgent() << 16;
+    return mixHash(v);
+  }
+
+  uint64_t RoughOcTree::computeSubtreeHash(const RoughOcTreeNode* node, const OcTreeKey& key, unsigned int depth) {
+    if (!this->nodeHasChildren(node))
+      return leafHash(node);
+    if (subtree_hashes_enabled) {
+      std::unordered_map<OcTreeKey, uint64_t, OcTreeKey::KeyHash>::const_iterator it = subtree_hashes.find(key);
+      if (it != subtree_hashes.end())
+        return it->second;
+    }
+
+    uint64_t h = mixHash(3);
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth + 1), key, child_key);
+      h = mixHash(h ^ (computeSubtreeHash(this->getNodeChild(node, i), child_key, depth + 1) + (i + 1) * 0x9e3779b97f4a7c15ull));
+    }
+    if (subtree_hashes_enabled)
+      subtree_hashes[key] = h;
+    return h;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryDataSubtrees(std::ostream &s,
+                                                     const std::vector<std::pair<OcTreeKey, unsigned int> >& subtrees) {
+    std::unordered_set<const RoughOcTreeNode*> nodes, roots;
+    if (this->root) {
+      nodes.insert(this->root);
+      for (size_t j=0; j<subtrees.size(); j++) {
+        const OcTreeKey& key = subtrees[j].first;
+        const RoughOcTreeNode* node = this->root;
+        for (unsigned int d=0; d<subtrees[j].second && node && this->nodeHasChildren(node); d++) {
+          const unsigned int pos = computeChildIdx(key, this->tree_depth - 1 - d);
+          node = this->nodeChildExists(node, pos) ? this->getNodeChild(node, pos) : NULL;
+          if (node) nodes.insert(node);
+        }
+        if (node) roots.insert(node);
+      }
+    }
+
+    BinaryFilter filter;
+    filter.nodes = &nodes;
+    filter.subtrees = &roots;
+    return writeFilteredBinaryData(s, filter);
+  }
+
+  std::istream& RoughOcTree::mergeBinaryData(std::istream &s) {
+    BinaryHeader header;
+    const bool has_header = readBinaryHeader(s, header);
+    if (!s)
+      return s;
+    if (has_header) {
+      applyBinaryHeader(header);
+      if (header.num_nodes == 0)
+        return s;
+    }
+
+    if (binary_encoding_mode != BINNING) {
+      OCTOMAP_ERROR("Only binning streams can be merged.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    std::vector<char> buf;
+    readRemaining(s, buf);
+    if (buf.empty())
+      return s;
+
+    // The merge can touch any subtree
+    if (!materializeAll()) {
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    if (!this->root) {
+      this->root = new RoughOcTreeNode();
+      this->tree_size++;
+      countDepthNode(this->root, 0, 1);
+    }
+
+    const std::vector<float> rough_lut = roughBinValues();
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    const char* end = buf.data() + buf.size();
+    const char* pos = dispatchBinningCodec<5>(num_rough_bits, binaryStairBits(), [&](auto rough, auto stair) {
+      return this->mergeBinningLoop<decltype(rough)::value, decltype(stair)::value>(buf.data(), end, this->root,
+                                                                                  rough_lut.data(), stair_lut.data());
+    });
+    this->size_changed = true;
+    clearSubtreeHashes();
+    // The nodes still on the merge stack are out of the counts
+    if (!pos)
+      invalidateDepthCounts();
+    if (tiles.active) {
+      std::vector<TileNode> tile_nodes, leaves;
+      const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+      collectTilesRecurs(this->root, 0, root_key, tile_nodes, leaves);
+      for (size_t t=0; t<tile_nodes.size(); t++) tiles.dirty.insert(tile_nodes[t].key);
+    }
+    if (!pos) {
+      OCTOMAP_ERROR("Binary stream ended before the tree was complete.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    unreadRemaining(s, end - pos);
+    return s;
+  }
+
+  void RoughOcTree::deleteNodeChildrenRecurs(RoughOcTreeNode* node) {
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      RoughOcTreeNode* child = this->getNodeChild(node, i);
+      if (this->nodeHasChildren(child)) deleteNodeChildrenRecurs(child);
+      this->deleteNodeChild(node, i);
+    }
+    delete[] node->children;
+    node->children = NULL;
+  }
+
+  template <uint RoughBits, uint StairBits>
+  const char* RoughOcTree::mergeBinningLoop(const char* data, const char* end, RoughOcTreeNode* node,
+                                            const float* rough_lut, const float* stair_lut) {
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+    const uint64_t rough_mask = (1ull << RoughBits) - 1;
+    const uint64_t stair_mask = (1ull << StairBits) - 1;
+
+    // Same walk as decodeBinningLoop, but into existing nodes: unknown children are left alone,
+    // leaf children replace whatever was there, and inner children are created or expanded.
+    // The inner nodes on the way are updated from their children once those are done. The
+    // depth counts hold every node but those on the stack, which is as deep as the tree.
+    struct Frame {
+      RoughOcTreeNode* node;
+      unsigned char inner_children[8];
+      unsigned char num_inner_children;
+      unsigned char next;
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+
+    RoughOcTreeNode* pending = node;
+    for (;;) {
+      if (pending) {
+        if (top == (int)max_codec_depth || end - data < (std::ptrdiff_t)bits_per_child) return NULL;
+        Frame& f = stack[++top];
+        f.node = pending;
+        f.num_inner_children = 0;
+        f.next = 0;
+        pending = NULL;
+        countDepthNode(f.node, top, -1);
+
+        uint64_t acc = 0;
+        uint acc_bits = 0;
+        for (unsigned int i=0; i<8; i++) {
+          while (acc_bits < bits_per_child) {
+            acc |= (uint64_t)(unsigned char)*data++ << acc_bits;
+            acc_bits += 8;
+          }
+          const uint64_t bits = acc;
+          acc >>= bits_per_child;
+          acc_bits -= bits_per_child;
+
+          const unsigned int code = bits & 3;
+          if (code == 0) continue; // 00 : not in the stream, keep ours
+
+          RoughOcTreeNode* child;
+          const bool existed = this->nodeChildExists(f.node, i);
+          if (existed) {
+            child = this->getNodeChild(f.node, i);
+          }
+          else {
+            child = this->createNodeChild(f.node, i);
+            countDepthNode(child, top+1, 1);
+          }
+
+          if (code == 3) { // 11 : child has children
+            // our leaf stands for all of its children until the stream says otherwise
+            if (existed && !this->nodeHasChildren(child)) {
+              countDepthNode(child, top+1, -1);
+              OccupancyOcTreeBase<RoughOcTreeNode>::expandNode(child);
+              countDepthNode(child, top+1, 1);
+              for (unsigned int k=0; k<8; k++) {
+                countDepthNode(this->getNodeChild(child, k), top+2, 1);
+              }
+            }
+            f.inner_children[f.num_inner_children++] = i;
+            continue;
+          }
+
+          // A leaf gets the values a fresh decode would give it
+          countDepthSubtreeRecurs(child, top+1, -1);
+          if (this->nodeHasChildren(child)) deleteNodeChildrenRecurs(child);
+          child->setRough(NAN);
+          child->setStairLogOdds(0);
+          if (code == 1) { // 10 : child is free
+            child->setLogOdds(this->clamping_thres_min);
+          }
+          else { // 01 : child is occupied
+            child->setLogOdds(this->clamping_thres_max);
+            if (RoughBits) {
+              child->setRough(rough_lut[(bits >> 2) & rough_mask]);
+            }
+            if (StairBits) {
+              child->setStairLogOdds(stair_lut[(bits >> (2 + RoughBits)) & stair_mask]);
+            }
+          }
+          countDepthNode(child, top+1, 1);
+        }
+      }
+
+      Frame& f = stack[top];
+      if (f.next < f.num_inner_children) {
+        pending = this->getNodeChild(f.node, f.inner_children[f.next++]);
+        continue;
+      }
+      if (this->nodeHasChildren(f.node)) {
+        f.node->updateOccupancyChildren();
+        f.node->updateRoughChildren();
+        f.node->updateStairChildren();
+      }
+      countDepthNode(f.node, top, 1);
+      if (top-- == 0) break;
+    }
+
+    return data;
+  }
+
+  const char* RoughOcTree::decodeBinaryNodeViaBinning(const char* data, const char* end, RoughOcTreeNode* node,
+                                                      size_t& num_nodes, BinarySubtreeIndex* index) {
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      return NULL;
+    }
+
+    const std::vector<float> rough_lut = roughBinValues();
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    return decodeBinningStream(data, end, node, num_nodes, index, num_rough_bits, binaryStairBits(), rough_lut.data(),
+                               stair_lut.data());
+  }
+
+  const char* RoughOcTree::decodeBinningStream(const char* data, const char* end, RoughOcTreeNode* node,
+                                               size_t& num_nodes, BinarySubtreeIndex* index, uint rough_bits, uint stair_bits,
+                                               const float* rough_lut, const float* stair_lut) {
+    const OcTreeKey root_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+    return dispatchBinningCodec<5>(rough_bits, stair_bits, [&](auto rough, auto stair) {
+      return this->decodeBinningRecurs<decltype(rough)::value, decltype(stair)::value>(data, end, node, num_nodes, rough_lut,
+                                                                                     stair_lut, 0, root_key, index);
+    });
+  }
+
+  void RoughOcTree::updateInnerBinningRecurs(RoughOcTreeNode* node, unsigned int depth, unsigned int split_depth) {
+    if (depth >= split_depth || !this->nodeHasChildren(node)) return;
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(node, i))
+        updateInnerBinningRecurs(this->getNodeChild(node, i), depth+1, split_depth);
+    }
+    node->setLogOdds(node->getMaxChildLogOdds());
+    node->setStairLogOdds(node->getMaxChildStairLogOdds());
+  }
+
+  template <uint RoughBits, uint StairBits, bool InnerAttributes>
+  inline void RoughOcTree::decodeBinningRecord(const char*& data, RoughOcTreeNode* node, size_t& num_nodes, const float* rough_lut,
+                                               const float* stair_lut, unsigned char* inner_children, unsigned char& num_inner_children) {
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+    const uint64_t rough_mask = (1ull << RoughBits) - 1;
+    const uint64_t stair_mask = (1ull << StairBits) - 1;
+
+    // inner nodes default to occupied
+    node->setLogOdds(this->clamping_thres_max);
+
+    // Child records are packed back to back, LSB first, so pull bytes into an accumulator
+    // until the next child is complete
+    uint64_t acc = 0;
+    uint acc_bits = 0;
+    num_inner_children = 0;
+    for (unsigned int i=0; i<8; i++) {
+      while (acc_bits < bits_per_child) {
+        acc |= (uint64_t)(unsigned char)*data++ << acc_bits;
+        acc_bits += 8;
+      }
+      const uint64_t bits = acc;
+      acc >>= bits_per_child;
+      acc_bits -= bits_per_child;
+
+      switch (bits & 3) {
+        case 1: { // 10 : child is free
+          RoughOcTreeNode* child = allocNodeChild(node, i, num_nodes);
+          child->setLogOdds(this->clamping_thres_min);
+          break;
+        }
+        case 2: { // 01 : child is occupied
+          RoughOcTreeNode* child = allocNodeChild(node, i, num_nodes);
+          child->setLogOdds(this->clamping_thres_max);
+          if (RoughBits) {
+            child->setRough(rough_lut[(bits >> 2) & rough_mask]);
+          }
+          if (StairBits) {
+            child->setStairLogOdds(stair_lut[(bits >> (2 + RoughBits)) & stair_mask]);
+          }
+          break;
+        }
+        case 3: { // 11 : child has children
+          RoughOcTreeNode* child = allocNodeChild(node, i, num_nodes);
+          if (InnerAttributes) {
+            if (RoughBits) {
+              child->setRough(rough_lut[(bits >> 2) & rough_mask]);
+            }
+            if (StairBits) {
+              child->setStairLogOdds(stair_lut[(bits >> (2 + RoughBits)) & stair_mask]);
+            }
+          }
+          inner_children[num_inner_children++] = i;
+          break;
+        }
+        default: // 00 : child is unknown
+          break;
+      }
+    }
+  }
+
+  template <uint RoughBits, uint StairBits>
+  const char* RoughOcTree::decodeBinningLoop(const char* data, const char* end, RoughOcTreeNode* node,
+                                             size_t& num_nodes, const float* rough_lut, const float* stair_lut) {
+
+    assert(node);
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+
+    // Explicit pre-order stack: one frame per inner node on the path to the current record,
+    // listing the inner children still to be read
+    struct Frame {
+      RoughOcTreeNode* node;
+      unsigned char inner_children[8];
+      unsigned char num_inner_children;
+      unsigned char next;
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+
+    RoughOcTreeNode* pending = node;
+    for (;;) {
+      if (pending) {
+        if (top == (int)max_codec_depth || end - data < (std::ptrdiff_t)bits_per_child) return NULL;
+        Frame& f = stack[++top];
+        f.node = pending;
+        f.next = 0;
+        pending = NULL;
+        decodeBinningRecord<RoughBits, StairBits, false>(data, f.node, num_nodes, rough_lut, stair_lut, f.inner_children,
+                                                         f.num_inner_children);
+      }
+
+      // read children's children and set the label
+      Frame& f = stack[top];
+      if (f.next < f.num_inner_children) {
+        pending = this->getNodeChild(f.node, f.inner_children[f.next++]);
+        continue;
+      }
+      if (top == 0) break;
+      f.node->setLogOdds(f.node->getMaxChildLogOdds());
+      f.node->setStairLogOdds(f.node->getMaxChildStairLogOdds());
+      top--;
+    }
+
+    return data;
+  }
+
+  template <uint RoughBits, uint StairBits>
+  const char* RoughOcTree::decodeBinningRecurs(const char* data, const char* end, RoughOcTreeNode* node,
+                                               size_t& num_nodes, const float* rough_lut, const float* stair_lut, unsigned int depth, const OcTreeKey& key,
+                                               BinarySubtreeIndex* index) {
+
+    assert(node);
+
+    // Without an index the whole subtree is read in one loop; the recursion only walks the
+    // few levels above the split depth of an indexed stream
+    if (!index) return decodeBinningLoop<RoughBits, StairBits>(data, end, node, num_nodes, rough_lut, stair_lut);
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+    if (end - data < (std::ptrdiff_t)bits_per_child) return NULL;
+
+    unsigned char inner_children[8];
+    unsigned char num_inner_children;
+    decodeBinningRecord<RoughBits, StairBits, false>(data, node, num_nodes, rough_lut, stair_lut, inner_children, num_inner_children);
+
+    for (uint k=0; k<num_inner_children; k++) {
+      const unsigned int i = inner_children[k];
+      RoughOcTreeNode* child = this->getNodeChild(node, i);
+
+      OcTreeKey child_key;
+      computeChildKey(i, this->tree_max_val >> (depth+1), key, child_key);
+      if (depth+1 == index->depth) {
+        // Below the split: note where the subtree is and jump over it
+        if (index->next == index->lengths.size() || index->lengths[index->next] > (uint64_t)(end - data)) return NULL;
+        const size_t length = index->lengths[index->next++];
+        bool wanted = true;
+        if (index->bbx_min) {
+          const int half = 1 << (this->tree_depth - depth - 2);
+          for (unsigned int a=0; a<3; a++) {
+            if (child_key[a] + half - 1 < (*index->bbx_min)[a] || child_key[a] - half > (*index->bbx_max)[a]) wanted = false;
+          }
         }
-      } // end if child exists
-    } // end for children
+        if (wanted) {
+          BinarySubtreeJob job = { child, child_key, data, length };
+          index->jobs.push_back(job);
+        }
+        else {
+          freeNodeChild(node, i, num_nodes);
+        }
+        data += length;
+        continue;
+      }
 
-    return s;
+      data = decodeBinningRecurs<RoughBits, StairBits>(data, end, child, num_nodes, rough_lut, stair_lut, depth+1,
+                                                       child_key, index);
+      if (!data) return NULL;
+      // Drop inner nodes whose subtrees were all skipped
+      if (!this->nodeHasChildren(child)) freeNodeChild(node, i, num_nodes);
+    }
+
+    return data;
   }
 
   std::ostream& RoughOcTree::writeBinaryNodeViaBinning(std::ostream &s, const RoughOcTreeNode* node) {
 
     assert(node);
 
+    // The readers reject an index split at or below the leaves, so none is written
+    const bool split_valid = binary_split_depth > 0 && binary_split_depth < this->tree_depth;
+    if (binary_subtree_index && binary_split_depth > 0 && !split_valid) {
+      OCTOMAP_ERROR("Subtree index needs a split depth between 1 and %u, got %u.\n", this->tree_depth - 1, binary_split_depth);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    const unsigned int threads = binary_encoding_threads ? binary_encoding_threads : std::thread::hardware_concurrency();
+    if (!split_valid || (threads <= 1 && !binary_subtree_index)) {
+      // Encode the whole subtree into one buffer and hand it to the stream in a single write.
+      // There is one record per inner node, which is usually well under an eighth of the tree.
+      std::vector<char> buf;
+      buf.reserve((this->tree_size / 8 + 1) * num_bits_per_node);
+      encodeBinaryNodeViaBinning(buf, node);
+      s.write(buf.data(), buf.size());
+      return s;
+    }
+
+    // The stream is a pre-order concatenation, so the records above the split depth are encoded
+    // here and every subtree below it separately, then all are written out in order
+    std::vector<char> top;
+    std::vector<std::pair<size_t, const RoughOcTreeNode*> > jobs;
+    encodeBinaryNodeViaBinning(top, node, binary_split_depth, &jobs);
+
+    std::vector<std::vector<char> > job_bufs(jobs.size());
+    std::atomic<size_t> next_job(0);
+    auto worker = [&]() {
+      for (size_t j = next_job++; j < jobs.size(); j = next_job++) {
+        encodeBinaryNodeViaBinning(job_bufs[j], jobs[j].second, 0, NULL, binary_split_depth);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int t=1; t<threads && t<jobs.size(); t++) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for (size_t t=0; t<pool.size(); t++) {
+      pool[t].join();
+    }
+
+    size_t prev = 0;
+    for (size_t j=0; j<jobs.size(); j++) {
+      s.write(top.data() + prev, jobs[j].first - prev);
+      s.write(job_bufs[j].data(), job_bufs[j].size());
+      prev = jobs[j].first;
+    }
+    s.write(top.data() + prev, top.size() - prev);
+
+    if (binary_subtree_index) {
+      writeSubtreeIndex(s, binary_split_depth, job_bufs);
+    }
+
+    return s;
+  }
+
+  void RoughOcTree::encodeBinaryNodeViaBinning(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int split_depth,
+                                               std::vector<std::pair<size_t, const RoughOcTreeNode*> >* split_jobs,
+                                               unsigned int depth, const BinaryFilter* filter) const {
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      return;
+    }
+
+    dispatchBinningCodec<5>(num_rough_bits, binaryStairBits(), [&](auto rough, auto stair) {
+      this->encodeBinningLoop<decltype(rough)::value, decltype(stair)::value>(buf, node, split_depth, split_jobs,
+                                                                              depth, filter);
+    });
+  }
+
+  template <uint RoughBits, uint StairBits, bool InnerAttributes>
+  inline unsigned int RoughOcTree::encodeBinningRecord(char* out, const RoughOcTreeNode* node, bool leaf_children,
+                                                       unsigned int child_mask, const std::bitset<256>* agents,
+                                                       const std::unordered_map<const RoughOcTreeNode*, float>* inner_rough) const {
+
+    // Child i owns bits [i*bits_per_child, (i+1)*bits_per_child) of the record, LSB first,
+    // as 2 occupancy bits, then the rough bits, then the stair bits. Unused attribute bits are zero.
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+    const uint64_t rough_mask = (1ull << RoughBits) - 1;
+
+    uint64_t acc = 0;
+    uint acc_bits = 0;
+    unsigned int inner_children = 0;
     for (unsigned int i=0; i<8; i++) {
-      const uint idx = i * num_bits_per_node;
-      if (this->nodeChildExists(node, i)) {
+      uint64_t bits = 0; // 00 : child is unknown
+      if (((child_mask >> i) & 1) && this->nodeChildExists(node, i)) {
         const RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if      (this->nodeHasChildren(child))  { children[idx] = 1; children[idx + 1] = 1; }
+        const bool inner = !leaf_children && this->nodeHasChildren(child);
+        if (inner) {
+          bits = 3; // 11 : child has children
+          inner_children |= 1u << i;
+        }
+        else if (agents && !(this->nodeHasChildren(child) ? subtreeHasAgent(child, *agents)
+                                                           : agents->test((unsigned char)child->getAgent()))) {
+          // observed by other agents, unknown
+        }
         else if (this->isNodeOccupied(child)) {
-          children[idx] = 0; children[idx + 1] = 1;
-          // Check the bool directly for fastest speed so we can ignore if not enabled
-          // If rough is set, but there's a NAN, there might be a problem with reading!
-          if (this->roughEnabled && child->isRoughSet()) {
-            rough_bits = floor(child->getRough() / binsize);
-            for (uint j=0; j<num_rough_bits; j++) {
-              children[idx + 2 + j] = rough_bits[j];
+          bits = 2; // 01 : child is occupied
+        }
+        else {
+          bits = 1; // 10 : child is free
+        }
+        if (bits == 2 || (InnerAttributes && inner)) {
+          if (RoughBits) {
+            const float rough = (inner_rough && this->nodeHasChildren(child)) ? inner_rough->at(child)
+                                                                               : encodedRough(child);
+            if (!isnan(rough))
+              bits |= (roughBin(rough) & rough_mask) << 2;
+          }
+          if (StairBits)
+            bits |= stairBin(child, StairBits) << (2 + RoughBits);
+        }
+      }
+
+      // Flush every completed byte
+      acc |= bits << acc_bits;
+      acc_bits += bits_per_child;
+      while (acc_bits >= 8) {
+        *out++ = (char)acc;
+        acc >>= 8;
+        acc_bits -= 8;
+      }
+    }
+    return inner_children;
+  }
+
+  template <uint RoughBits, uint StairBits>
+  void RoughOcTree::encodeBinningLoop(std::vector<char>& buf, const RoughOcTreeNode* node, unsigned int split_depth,
+                                      std::vector<std::pair<size_t, const RoughOcTreeNode*> >* split_jobs,
+                                      unsigned int depth, const BinaryFilter* filter) const {
+
+    assert(node);
+
+    const OcTreeKey* bbx_min = filter ? filter->bbx_min : NULL;
+    const OcTreeKey* bbx_max = filter ? filter->bbx_max : NULL;
+    const std::bitset<256>* agents = filter ? filter->agents : NULL;
+    const std::unordered_set<const RoughOcTreeNode*>* nodes = filter ? filter->nodes : NULL;
+    const std::unordered_set<const RoughOcTreeNode*>* subtrees = filter ? filter->subtrees : NULL;
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+
+    // Explicit pre-order stack: the inner nodes on the path to the current record and
+    // which of their inner children are still to be written
+    struct Frame {
+      const RoughOcTreeNode* node;
+      unsigned int inner_children; // bit mask
+      OcTreeKey child_keys[8]; // only kept with a box
+      size_t pos; // of the record in buf
+      unsigned int index; // of the node in its parent
+      bool whole; // inside one of filter->subtrees
+    };
+    Frame stack[max_codec_depth + 1];
+    int top = -1;
+    const unsigned int leaf_depth = binaryLeafDepth();
+
+    const RoughOcTreeNode* pending = node;
+    unsigned int pending_index = 0;
+    OcTreeKey pending_key(this->tree_max_val, this->tree_max_val, this->tree_max_val);
+    for (;;) {
+      if (pending) {
+        Frame& f = stack[++top];
+        const unsigned int child_depth = depth + top + 1;
+        // With a box, children that do not intersect it are written as unknown
+        unsigned int child_mask = 0xFF;
+        if (bbx_min) {
+          child_mask = 0;
+          const unsigned int size = 1u << (this->tree_depth - child_depth);
+          for (unsigned int i=0; i<8; i++) {
+            computeChildKey(i, this->tree_max_val >> child_depth, pending_key, f.child_keys[i]);
+            bool inside = true;
+            for (unsigned int a=0; a<3; a++) {
+              const unsigned int lo = f.child_keys[i][a] - (size >> 1);
+              if (lo + size - 1 < (*bbx_min)[a] || lo > (*bbx_max)[a]) inside = false;
             }
+            if (inside) child_mask |= 1u << i;
           }
-          if (this->stairsEnabled && this->isNodeStairs(child)) {
-            children[idx + 2 + num_rough_bits] = 1;
-          } else {
-            children[idx + 2 + num_rough_bits] = 0;
+        }
+        f.whole = subtrees && ((top > 0 && stack[top-1].whole) || subtrees->count(pending));
+        if (nodes && !f.whole) {
+          for (unsigned int i=0; i<8; i++) {
+            if (this->nodeChildExists(pending, i) && !nodes->count(this->getNodeChild(pending, i)))
+              child_mask &= ~(1u << i);
           }
         }
-        else { children[idx] = 1; children[idx + 1] = 0; }
+
+        const bool leaf_children = child_depth >= leaf_depth;
+
+        const size_t pos = buf.size();
+        buf.resize(pos + bits_per_child);
+        f.node = pending;
+        f.inner_children = encodeBinningRecord<RoughBits, StairBits, false>(&buf[pos], pending, leaf_children, child_mask, agents);
+        f.pos = pos;
+        f.index = pending_index;
+        pending = NULL;
+      }
+
+      // write children's children
+      Frame& f = stack[top];
+      if (!f.inner_children) {
+        // An inner node left with nothing by the filters is dropped, and marked unknown in its
+        // parent instead
+        if (filter && top > 0 && buf.size() == f.pos + bits_per_child &&
+            std::count(buf.begin() + f.pos, buf.end(), 0) == (std::ptrdiff_t)bits_per_child) {
+          buf.resize(f.pos);
+          const unsigned int bit = f.index * bits_per_child;
+          for (unsigned int b=bit; b<bit+2; b++)
+            buf[stack[top-1].pos + b / 8] &= ~(1 << (b % 8));
+        }
+        if (top-- == 0) break;
+        continue;
+      }
+      unsigned int i = 0;
+      while (!((f.inner_children >> i) & 1)) i++;
+      f.inner_children &= f.inner_children - 1;
+      const RoughOcTreeNode* child = this->getNodeChild(f.node, i);
+      const unsigned int child_level = top + 1; // below node, top is f's level
+      if (split_jobs && split_depth == child_level)
+        split_jobs->push_back(std::make_pair(buf.size(), child));
+      else {
+        pending = child;
+        pending_index = i;
+        if (bbx_min) pending_key = f.child_keys[i];
+      }
+    }
+  }
+
+  float RoughOcTree::aggregateRough(const RoughOcTreeNode* node,
+                                    std::unordered_map<const RoughOcTreeNode*, float>* cache) const {
+    if (!this->nodeHasChildren(node))
+      return node->getRough();
+    double m = 0;
+    int c = 0;
+    for (unsigned int i=0; i<8; i++) {
+      if (!this->nodeChildExists(node, i)) continue;
+      const float r = aggregateRough(this->getNodeChild(node, i), cache);
+      if (!isnan(r)) {
+        m += r;
+        ++c;
       }
-      else { children[idx] = 0; children[idx + 1] = 0; }
     }
+    const float rough = c > 0 ? (float)(m / c) : NAN;
+    if (cache) (*cache)[node] = rough;
+    return rough;
+  }
 
-    // If children length is not divisible by 8, may have issues!
-    for (int i=0; i < num_bits_per_node; ++i) {
-      char children_char = (char)((children >> (8 * i)) & bitmask).to_ulong();
-      s.write((char*)&children_char, sizeof(char));
+  bool RoughOcTree::subtreeHasAgent(const RoughOcTreeNode* node, const std::bitset<256>& agents) const {
+    if (!this->nodeHasChildren(node))
+      return agents[(unsigned char)node->getAgent()];
+    for (unsigned int i=0; i<8; i++) {
+      if (this->nodeChildExists(node, i) && subtreeHasAgent(this->getNodeChild(node, i), agents))
+        return true;
     }
+    return false;
+  }
 
-    // write children's children
+  std::istream& RoughOcTree::readBinaryNodeViaProgressiveBinning(std::istream &s, RoughOcTreeNode* node) {
+    assert(node);
+
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    // A cut short stream is not an error, it just decodes to a coarser map
+    std::vector<char> buf;
+    readRemaining(s, buf, binary_inner_nodes_follow * (num_bits_per_node + 1));
+    const std::vector<float> rough_lut = roughBinValues();
+    const std::vector<float> stair_lut = stairBinValues(binaryStairBits());
+    const char* end = buf.data() + buf.size();
+    const char* pos = dispatchBinningCodec<5>(num_rough_bits, binaryStairBits(), [&](auto rough, auto stair) {
+      return this->decodeProgressiveLevels<decltype(rough)::value, decltype(stair)::value>(buf.data(), end, node, this->tree_size,
+                                                                                         rough_lut.data(), stair_lut.data());
+    });
+    if (!pos) {
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+    unreadRemaining(s, end - pos);
+    return s;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryNodeViaProgressiveBinning(std::ostream &s, const RoughOcTreeNode* node) {
+    assert(node);
+
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    std::vector<char> buf;
+    buf.reserve((this->tree_size / 8 + 1) * (num_bits_per_node + 1));
+    dispatchBinningCodec<5>(num_rough_bits, binaryStairBits(), [&](auto rough, auto stair) {
+      this->encodeProgressiveLevels<decltype(rough)::value, decltype(stair)::value>(buf, node);
+    });
+    s.write(buf.data(), buf.size());
+    return s;
+  }
+
+  template <uint RoughBits, uint StairBits>
+  void RoughOcTree::encodeProgressiveLevels(std::vector<char>& buf, const RoughOcTreeNode* node) const {
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+
+    // Breadth first: the records of one level, in order, then those of the next.
+    // The queue is the list of inner nodes in stream order, filled as records are written.
+    std::vector<const RoughOcTreeNode*> queue(1, node);
+    const unsigned int leaf_depth = binaryLeafDepth();
+    unsigned int depth = 0;
+
+    // Every inner node carries its aggregated rough, so gather them all in one pass
+    std::unordered_map<const RoughOcTreeNode*, float> inner_rough;
+    if (RoughBits)
+      aggregateRough(node, &inner_rough);
+
+    size_t level_end = 1;
+    for (size_t q=0; q<queue.size(); q++) {
+      if (q == level_end) {
+        depth++;
+        level_end = queue.size();
+      }
+      const RoughOcTreeNode* n = queue[q];
+      const size_t pos = buf.size();
+      buf.resize(pos + bits_per_child + 1);
+      const unsigned int inner_children = encodeBinningRecord<RoughBits, StairBits, true>(&buf[pos], n, depth + 1 >= leaf_depth,
+                                                                                         0xFF, NULL, &inner_rough);
+
+      // Trailing byte: which inner children are occupied, so they can stand in for their subtree
+      unsigned int occupied = 0;
+      for (unsigned int i=0; i<8; i++) {
+        if (!((inner_children >> i) & 1)) continue;
+        const RoughOcTreeNode* child = this->getNodeChild(n, i);
+        if (this->isNodeOccupied(child)) occupied |= 1u << i;
+        queue.push_back(child);
+      }
+      buf[pos + bits_per_child] = (char)occupied;
+    }
+  }
+
+  template <uint RoughBits, uint StairBits>
+  const char* RoughOcTree::decodeProgressiveLevels(const char* data, const char* end, RoughOcTreeNode* node,
+                                                   size_t& num_nodes, const float* rough_lut, const float* stair_lut) {
+
+    const uint bits_per_child = 2 + RoughBits + StairBits;
+
+    // inner nodes default to occupied
+    node->setLogOdds(this->clamping_thres_max);
+
+    // Nodes whose records have not been read yet are leaves with the values their parent's
+    // record gave them, so the tree is a valid coarser map wherever the data stops
+    // Every node in the queue gets a record, so the stream bounds what the header may announce
+    std::vector<RoughOcTreeNode*> queue(1, node);
+    queue.reserve(std::min<uint64_t>(binary_inner_nodes_follow, (end - data) / (bits_per_child + 1) + 1));
+    unsigned int depth = 0;
+    size_t level_end = 1;
+    for (size_t q=0; q<queue.size(); q++) {
+      if (end - data < (std::ptrdiff_t)bits_per_child + 1) break;
+      if (q == level_end) {
+        depth++;
+        level_end = queue.size();
+      }
+      RoughOcTreeNode* n = queue[q];
+      // keep the node's own value, the record only describes its children
+      const float log_odds = n->getLogOdds();
+      unsigned char inner_children[8];
+      unsigned char num_inner_children;
+      decodeBinningRecord<RoughBits, StairBits, true>(data, n, num_nodes, rough_lut, stair_lut, inner_children, num_inner_children);
+      n->setLogOdds(log_odds);
+      // A corrupt stream could otherwise keep announcing inner children below the leaves
+      if (num_inner_children && depth + 1 >= this->tree_depth) {
+        OCTOMAP_ERROR("Binary stream nests nodes deeper than the tree depth %u.\n", this->tree_depth);
+        return NULL;
+      }
+
+      const unsigned int occupied = (unsigned char)*data++;
+      for (uint k=0; k<num_inner_children; k++) {
+        RoughOcTreeNode* child = this->getNodeChild(n, inner_children[k]);
+        child->setLogOdds(((occupied >> inner_children[k]) & 1) ? this->clamping_thres_max : this->clamping_thres_min);
+        queue.push_back(child);
+      }
+    }
+
+    return data;
+  }
+
+  std::istream& RoughOcTree::readBinaryNodeViaVariableBinning(std::istream &s, RoughOcTreeNode* node) {
+    assert(node);
+
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    std::vector<char> buf;
+    readRemaining(s, buf);
+
+    const std::vector<float> rough_lut = roughBinValues();
+    BitReader r(buf.data(), buf.data() + buf.size());
+    if (!dispatchBinningCodec<2>(num_rough_bits, this->stairsEnabled, [&](auto rough, auto stairs) {
+          return this->decodeVariableRecurs<decltype(rough)::value, decltype(stairs)::value != 0>(r, node, rough_lut.data(), 0);
+        })) {
+      if (r.overrun())
+        OCTOMAP_ERROR("Binary stream ended before the tree was complete.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    unreadRemaining(s, buf.data() + buf.size() - r.position());
+    return s;
+  }
+
+  std::ostream& RoughOcTree::writeBinaryNodeViaVariableBinning(std::ostream &s, const RoughOcTreeNode* node) {
+    assert(node);
+
+    if (num_rough_bits > 8) {
+      OCTOMAP_ERROR("No binning codec for %u bins.\n", num_binary_bins);
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    std::vector<char> buf;
+    buf.reserve(this->tree_size / 4 + 1);
+    BitWriter w(buf);
+    dispatchBinningCodec<2>(num_rough_bits, this->stairsEnabled, [&](auto rough, auto stairs) {
+      this->encodeVariableRecurs<decltype(rough)::value, decltype(stairs)::value != 0>(w, node, 0);
+    });
+    w.flush();
+    s.write(buf.data(), buf.size());
+
+    return s;
+  }
+
+  template <uint RoughBits, bool Stairs>
+  void RoughOcTree::encodeVariableRecurs(BitWriter& w, const RoughOcTreeNode* node, unsigned int depth) const {
+
+    assert(node);
+
+    const bool leaf_children = depth + 1 >= binaryLeafDepth();
+
+    const uint attr_bits = RoughBits + Stairs;
+    const uint64_t rough_mask = (1ull << RoughBits) - 1;
+
+    // Same 2-bit codes as binning, all 8 children in one 16-bit field
+    uint64_t codes = 0;
+    uint64_t attrs[8];
+    uint num_attrs = 0;
+    bool has_inner_children = false;
     for (unsigned int i=0; i<8; i++) {
+      uint64_t code = 0; // 00 : child is unknown
       if (this->nodeChildExists(node, i)) {
         const RoughOcTreeNode* child = this->getNodeChild(node, i);
-        if (this->nodeHasChildren(child)) {
-          writeBinaryNode(s, child);
+        if (!leaf_children && this->nodeHasChildren(child)) {
+          code = 3; // 11 : child has children
+          has_inner_children = true;
+        }
+        else if (this->isNodeOccupied(child)) {
+          code = 2; // 01 : child is occupied
+          uint64_t a = 0;
+          if (RoughBits) {
+            const float rough = encodedRough(child);
+            if (!isnan(rough))
+              a = roughBin(rough) & rough_mask;
+          }
+          if (Stairs && this->isNodeStairs(child))
+            a |= 1ull << RoughBits;
+          attrs[num_attrs++] = a;
+        }
+        else {
+          code = 1; // 10 : child is free
+        }
+      }
+      codes |= code << (2 * i);
+    }
+
+    w.write(codes, 16);
+    if (attr_bits) {
+      for (uint i=0; i<num_attrs; i++) {
+        w.write(attrs[i], attr_bits);
+      }
+    }
+
+    // write children's children
+    if (has_inner_children) {
+      for (unsigned int i=0; i<8; i++) {
+        if (this->nodeChildExists(node, i)) {
+          const RoughOcTreeNode* child = this->getNodeChild(node, i);
+          if (this->nodeHasChildren(child)) {
+            encodeVariableRecurs<RoughBits, Stairs>(w, child, depth+1);
+          }
+        }
+      }
+    }
+  }
+
+  template <uint RoughBits, bool Stairs>
+  bool RoughOcTree::decodeVariableRecurs(BitReader& r, RoughOcTreeNode* node, const float* rough_lut, unsigned int depth) {
+
+    assert(node);
+
+    // A corrupt stream could otherwise nest inner nodes without bound
+    if (depth >= this->tree_depth) {
+      OCTOMAP_ERROR("Binary stream nests nodes deeper than the tree depth %u.\n", this->tree_depth);
+      return false;
+    }
+
+    const uint attr_bits = RoughBits + Stairs;
+    const uint64_t rough_mask = (1ull << RoughBits) - 1;
+
+    const uint64_t codes = r.read(16);
+    if (r.overrun()) return false;
+
+    // inner nodes default to occupied
+    node->setLogOdds(this->clamping_thres_max);
+
+    RoughOcTreeNode* inner_children[8];
+    uint num_inner_children = 0;
+    for (unsigned int i=0; i<8; i++) {
+      switch ((codes >> (2 * i)) & 3) {
+        case 1: { // 10 : child is free
+          RoughOcTreeNode* child = this->createNodeChild(node, i);
+          child->setLogOdds(this->clamping_thres_min);
+          break;
+        }
+        case 2: { // 01 : child is occupied
+          RoughOcTreeNode* child = this->createNodeChild(node, i);
+          child->setLogOdds(this->clamping_thres_max);
+          if (attr_bits) {
+            const uint64_t a = r.read(attr_bits);
+            if (RoughBits) {
+              child->setRough(rough_lut[a & rough_mask]);
+            }
+            if (Stairs) {
+              child->setStairLogOdds(((a >> RoughBits) & 1) ? this->stairs_clamping_thres_max
+                                                            : this->stairs_clamping_thres_min);
+            }
+          }
+          break;
+        }
+        case 3: // 11 : child has children
+          inner_children[num_inner_children++] = this->createNodeChild(node, i);
+          break;
+        default: // 00 : child is unknown
+          break;
+      }
+    }
+    if (r.overrun()) return false;
+
+    // read children's children and set the label
+    for (uint i=0; i<num_inner_children; i++) {
+      RoughOcTreeNode* child = inner_children[i];
+      if (!decodeVariableRecurs<RoughBits, Stairs>(r, child, rough_lut, depth+1)) return false;
+      child->setLogOdds(child->getMaxChildLogOdds());
+      child->setStairLogOdds(child->getMaxChildStairLogOdds());
+    }
+
+    return true;
+  }
+
+  RoughOcTree::ArithmeticContexts::ArithmeticContexts(unsigned int num_rough_bits)
+  : prev_rough(0), prev_stairs(0) {
+    std::fill(&codes[0][0][0][0], &codes[0][0][0][0] + sizeof(codes) / sizeof(range_coding::Prob), range_coding::prob_init);
+    std::fill(stairs, stairs + 2, range_coding::prob_init);
+    // Up to 8 rough contexts, from the top 3 bits of the previous bin
+    rough_ctx_shift = num_rough_bits > 3 ? num_rough_bits - 3 : 0;
+    rough.assign((size_t)(1u << (num_rough_bits - rough_ctx_shift)) << num_rough_bits, range_coding::prob_init);
+  }
+
+  std::ostream& RoughOcTree::writeBinaryNodeViaArithmeticCoding(std::ostream &s, const RoughOcTreeNode* node) {
+
+    assert(node);
+
+    std::vector<char> buf;
+    buf.reserve(this->tree_size / 16 + 16);
+    RangeEncoder rc(buf);
+    ArithmeticContexts ctx(num_rough_bits);
+    encodeArithmeticRecurs(rc, ctx, node, 0);
+    rc.flush();
+    s.write(buf.data(), buf.size());
+
+    return s;
+  }
+
+  void RoughOcTree::encodeArithmeticRecurs(RangeEncoder& rc, ArithmeticContexts& ctx, const RoughOcTreeNode* node,
+                                           unsigned int depth) const {
+
+    assert(node);
+
+    const uint32_t rough_mask = (1u << num_rough_bits) - 1;
+    const unsigned int leaf_depth = binaryLeafDepth();
+
+    unsigned int codes[8];
+    bool has_inner_children = false;
+    for (unsigned int i=0; i<8; i++) {
+      unsigned int code = 0; // 00 : child is unknown
+      const RoughOcTreeNode* child = NULL;
+      if (this->nodeChildExists(node, i)) {
+        child = this->getNodeChild(node, i);
+        if (depth + 1 < leaf_depth && this->nodeHasChildren(child)) {
+          code = 3; // 11 : child has children
+          has_inner_children = true;
+        }
+        else if (this->isNodeOccupied(child)) code = 2; // 01 : child is occupied
+        else code = 1; // 10 : child is free
+      }
+      codes[i] = code;
+
+      // Neighbours along x, and along z or y, that are already coded
+      const unsigned int nx = (i & 1) ? codes[i - 1] : 0;
+      const unsigned int nyz = (i >= 4) ? codes[i - 4] : ((i >= 2) ? codes[i - 2] : 0);
+      rc.encodeTree(ctx.codes[depth][nx][nyz], code, 2);
+
+      if (code == 2) {
+        if (num_rough_bits) {
+          uint32_t bin = 0;
+          const float rough = encodedRough(child);
+          if (!isnan(rough))
+            bin = (uint32_t)roughBin(rough) & rough_mask;
+          rc.encodeTree(&ctx.rough[(size_t)(ctx.prev_rough >> ctx.rough_ctx_shift) << num_rough_bits], bin, num_rough_bits);
+          ctx.prev_rough = bin;
+        }
+        if (this->stairsEnabled) {
+          const unsigned int stairs = this->isNodeStairs(child);
+          rc.encode(ctx.stairs[ctx.prev_stairs], stairs);
+          ctx.prev_stairs = stairs;
         }
       }
     }
 
+    // write children's children
+    if (has_inner_children) {
+      for (unsigned int i=0; i<8; i++) {
+        if (codes[i] == 3)
+          encodeArithmeticRecurs(rc, ctx, this->getNodeChild(node, i), depth+1);
+      }
+    }
+  }
+
+  std::istream& RoughOcTree::readBinaryNodeViaArithmeticCoding(std::istream &s, RoughOcTreeNode* node) {
+
+    assert(node);
+
+    std::vector<char> buf;
+    readRemaining(s, buf);
+
+    const std::vector<float> rough_lut = roughBinValues();
+    RangeDecoder rc(buf.data(), buf.data() + buf.size());
+    ArithmeticContexts ctx(num_rough_bits);
+    if (!decodeArithmeticRecurs(rc, ctx, node, this->tree_size, 0, rough_lut.data())) {
+      OCTOMAP_ERROR("Binary stream ended before the tree was complete.\n");
+      s.setstate(std::ios_base::failbit);
+      return s;
+    }
+
+    unreadRemaining(s, buf.data() + buf.size() - rc.position());
     return s;
   }
 
+  bool RoughOcTree::decodeArithmeticRecurs(RangeDecoder& rc, ArithmeticContexts& ctx, RoughOcTreeNode* node,
+                                           size_t& num_nodes, unsigned int depth, const float* rough_lut) {
+
+    assert(node);
+
+    if (depth >= this->tree_depth) return false;
+
+    // inner nodes default to occupied
+    node->setLogOdds(this->clamping_thres_max);
+
+    unsigned int codes[8];
+    for (unsigned int i=0; i<8; i++) {
+      const unsigned int nx = (i & 1) ? codes[i - 1] : 0;
+      const unsigned int nyz = (i >= 4) ? codes[i - 4] : ((i >= 2) ? codes[i - 2] : 0);
+      const unsigned int code = rc.decodeTree(ctx.codes[depth][nx][nyz], 2);
+      codes[i] = code;
+
+      switch (code) {
+        case 1: { // 10 : child is free
+          RoughOcTreeNode* child = allocNodeChild(node, i, num_nodes);
+          child->setLogOdds(this->clamping_thres_min);
+          break;
+        }
+        case 2: { // 01 : child is occupied
+          RoughOcTreeNode* child = allocNodeChild(node, i, num_nodes);
+          child->setLogOdds(this->clamping_thres_max);
+          if (num_rough_bits) {
+            const uint32_t bin = rc.decodeTree(&ctx.rough[(size_t)(ctx.prev_rough >> ctx.rough_ctx_shift) << num_rough_bits], num_rough_bits);
+            child->setRough(rough_lut[bin]);
+            ctx.prev_rough = bin;
+          }
+          if (this->stairsEnabled) {
+            const unsigned int stairs = rc.decode(ctx.stairs[ctx.prev_stairs]);
+            child->setStairLogOdds(stairs ? this->stairs_clamping_thres_max : this->stairs_clamping_thres_min);
+            ctx.prev_stairs = stairs;
+          }
+          break;
+        }
+        case 3: // 11 : child has children
+          allocNodeChild(node, i, num_nodes);
+          break;
+        default: // 00 : child is unknown
+          break;
+      }
+    }
+    if (rc.overrun()) return false;
+
+    // read children's children and set the label
+    for (unsigned int i=0; i<8; i++) {
+      if (codes[i] != 3) continue;
+      RoughOcTreeNode* child = this->getNodeChild(node, i);
+      if (!decodeArithmeticRecurs(rc, ctx, child, num_nodes, depth+1, rough_lut)) return false;
+      child->setLogOdds(child->getMaxChildLogOdds());
+      child->setStairLogOdds(child->getMaxChildStairLogOdds());
+    }
+
+    return true;
+  }
+
   void RoughOcTree::writeRoughHistogram(std::string filename) {
 #ifdef _MSC_VER
     fprintf(stderr, "The rough histogram uses gnuplot, this is not supported under windows.\n");
@@ -0,0 +1,152 @@
+// Binary codec benchmark: encodes and decodes a generated terrain map and reports the
+// throughput in MB/s of encoded data, best of several runs, for binning, arithmetic coding
+// and binning with zstd on top. Exits non-zero if a codec does not decode to the same leaves
+// as binning.
+//   rough_octomap_codec_benchmark [extent in m] [runs]
+
+#include <rough_octomap/Compression.h>
+#include <rough_octomap/RoughOcTree.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace octomap;
+
+namespace {
+
+  const double resolution = 0.05;
+
+  struct CodecResult {
+    size_t bytes = 0;
+    double encode_s = 1e9;
+    double decode_s = 1e9;
+    std::string leaves; // of the decoded tree
+  };
+
+  void configure(RoughOcTree& tree, RoughBinaryEncodingMode mode) {
+    tree.setNumBins(16);
+    tree.setStairsEnabled(true);
+    tree.binary_encoding_mode = mode;
+  }
+
+  double secondsSince(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Rolling ground with free space above it, some walls and a flight of stairs; rough follows
+  // the slope, so neighbouring voxels have similar bins as in a real map
+  void generateMap(RoughOcTree& tree, double extent) {
+    for (double x = -extent / 2; x < extent / 2; x += resolution) {
+      for (double y = -extent / 2; y < extent / 2; y += resolution) {
+        const double z = 0.4 * std::sin(0.3 * x) * std::cos(0.2 * y) + 0.05 * std::sin(3.0 * x + 2.0 * y);
+        const double slope = std::abs(0.12 * std::cos(0.3 * x) * std::cos(0.2 * y) + 0.15 * std::cos(3.0 * x + 2.0 * y));
+        const bool stairs = x > 2 && x < 4 && y > -1 && y < 1;
+        const double ground = stairs ? 0.2 * std::floor((x - 2) / 0.25) : z;
+        OcTreeKey key;
+        if (!tree.coordToKeyChecked(point3d(x, y, ground), key)) continue;
+        tree.updateNode(key, true);
+        tree.setNodeRough(key, std::min(1.0, slope * 4));
+        tree.setNodeStairLogOdds(key, stairs ? 3.0f : -2.0f);
+        for (int i=1; i<=6; i++) {
+          if (tree.coordToKeyChecked(point3d(x, y, ground + i * resolution), key))
+            tree.updateNode(key, false);
+        }
+        const bool wall = std::fmod(std::abs(x) + 100, 10.0) < resolution || std::fmod(std::abs(y) + 100, 15.0) < resolution;
+        for (int i=1; wall && i<=20; i++) {
+          if (tree.coordToKeyChecked(point3d(x, y, ground + i * resolution), key)) {
+            tree.updateNode(key, true);
+            tree.setNodeRough(key, 0.9f);
+          }
+        }
+      }
+    }
+    tree.updateInnerOccupancy();
+  }
+
+  std::string leafDump(const RoughOcTree& tree) {
+    std::ostringstream out;
+    for (RoughOcTree::leaf_iterator it = tree.begin_leafs(), end = tree.end_leafs(); it != end; ++it) {
+      out << it.getKey()[0] << " " << it.getKey()[1] << " " << it.getKey()[2] << " " << it.getDepth() << " "
+          << tree.isNodeOccupied(*it) << " " << it->getRough() << " " << it->getStairLogOdds() << "\n";
+    }
+    return out.str();
+  }
+
+  // The compression stage runs streaming over the encoder output, as binaryMapToMsg does
+  CodecResult measure(RoughOcTree& tree, RoughBinaryEncodingMode mode, int runs,
+                      RoughCompressionMode compression = NO_COMPRESSION) {
+    CodecResult result;
+    configure(tree, mode);
+    std::vector<int8_t> data;
+    for (int run=0; run<runs; run++) {
+      data.clear();
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      if (compression != NO_COMPRESSION) {
+        CompressingBuffer buffer(data, compression);
+        std::ostream s(&buffer);
+        tree.writeBinaryData(s);
+        buffer.finish();
+      } else {
+        std::stringstream s;
+        tree.writeBinaryData(s);
+        const std::string str = s.str();
+        data.assign(str.begin(), str.end());
+      }
+      result.encode_s = std::min(result.encode_s, secondsSince(start));
+    }
+    result.bytes = data.size();
+    for (int run=0; run<runs; run++) {
+      RoughOcTree decoded(tree.getResolution());
+      configure(decoded, mode);
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      if (compression != NO_COMPRESSION) {
+        DecompressingBuffer buffer((const char*) data.data(), data.size(), compression);
+        std::istream s(&buffer);
+        decoded.readBinaryData(s);
+      } else {
+        std::istringstream s(std::string((const char*) data.data(), data.size()));
+        decoded.readBinaryData(s);
+      }
+      result.decode_s = std::min(result.decode_s, secondsSince(start));
+      if (run == runs - 1)
+        result.leaves = leafDump(decoded);
+    }
+    return result;
+  }
+
+  // Sizes and speeds relative to binning, and whether the decoded leaves match it
+  bool print(const char* name, const CodecResult& result, const CodecResult& binning) {
+    const bool same = result.leaves == binning.leaves;
+    printf("%-16s %10zu bytes (%5.1f%%)  encode %8.1f MB/s (%5.2fx)  decode %8.1f MB/s (%5.2fx)  %s\n", name,
+           result.bytes, 100.0 * result.bytes / binning.bytes, result.bytes / result.encode_s / 1e6,
+           binning.encode_s / result.encode_s, result.bytes / result.decode_s / 1e6,
+           binning.decode_s / result.decode_s, same ? "round trip ok" : "ROUND TRIP DIFFERS");
+    return same;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  const double extent = argc > 1 ? std::atof(argv[1]) : 40.0;
+  const int runs = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+
+  RoughOcTree tree(resolution);
+  configure(tree, BINNING);
+  generateMap(tree, extent);
+  printf("map: %.0f m across, %zu nodes\n", extent, tree.size());
+
+  const CodecResult binning = measure(tree, BINNING, runs);
+  bool ok = print("BINNING", binning, binning);
+  ok = print("ARITHMETIC", measure(tree, ARITHMETIC_CODING, runs), binning) && ok;
+  if (compressionAvailable(ZSTD_COMPRESSION))
+    ok = print("BINNING + zstd", measure(tree, BINNING, runs, ZSTD_COMPRESSION), binning) && ok;
+  else
+    printf("%-16s not built in\n", "BINNING + zstd");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+// Map synchronization check: two robots start from a shared map, explore apart, then pull
+// each other's differing subtrees by comparing subtree hashes top-down. Everything a peer
+// sends goes through a byte buffer, as it would over a link. Exits non-zero unless both
+// trees end up with equal root hashes and identical leaves.
+
+#include <rough_octomap/RoughOcTree.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace octomap;
+
+namespace {
+
+  typedef std::vector<std::pair<OcTreeKey, unsigned int> > NodeList;
+
+  // Message kinds, first byte of every request
+  const char child_hash_request = 'H';
+  const char subtree_request = 'S';
+
+  struct LinkStats {
+    size_t bytes = 0;
+    size_t messages = 0;
+  };
+
+  template <typename T>
+  void put(std::string& buf, const T& value) {
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  T get(const std::string& buf, size_t& pos) {
+    T value;
+    std::memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  std::string encodeNodes(char kind, const NodeList& nodes) {
+    std::string buf(1, kind);
+    put(buf, (uint32_t)nodes.size());
+    for (size_t i=0; i<nodes.size(); i++) {
+      for (unsigned int j=0; j<3; j++) put(buf, (uint16_t)nodes[i].first[j]);
+      put(buf, (uint8_t)nodes[i].second);
+    }
+    return buf;
+  }
+
+  NodeList decodeNodes(const std::string& buf, size_t& pos) {
+    NodeList nodes(get<uint32_t>(buf, pos));
+    for (size_t i=0; i<nodes.size(); i++) {
+      for (unsigned int j=0; j<3; j++) nodes[i].first[j] = get<uint16_t>(buf, pos);
+      nodes[i].second = get<uint8_t>(buf, pos);
+    }
+    return nodes;
+  }
+
+  // Peer side: answers a request from its own tree
+  std::string serve(RoughOcTree& tree, const std::string& request) {
+    size_t pos = 1;
+    const NodeList nodes = decodeNodes(request, pos);
+    std::string reply;
+    if (request[0] == child_hash_request) {
+      // per node: 1 and its 8 child hashes if it is inner, 0 otherwise
+      for (size_t i=0; i<nodes.size(); i++) {
+        uint64_t hashes[8];
+        const bool inner = tree.getChildHashes(nodes[i].first, nodes[i].second, hashes);
+        put(reply, (uint8_t)inner);
+        if (inner) reply.append(reinterpret_cast<const char*>(hashes), sizeof(hashes));
+      }
+    } else if (request[0] == subtree_request) {
+      std::stringstream s;
+      tree.writeBinaryDataSubtrees(s, nodes);
+      reply = s.str();
+    }
+    return reply;
+  }
+
+  std::string exchange(RoughOcTree& peer, const std::string& request, LinkStats& stats) {
+    const std::string reply = serve(peer, request);
+    stats.bytes += request.size() + reply.size();
+    stats.messages += 2;
+    return reply;
+  }
+
+  // Requester side: finds the subtrees where the peer differs and merges the peer's version
+  bool pull(RoughOcTree& tree, RoughOcTree& peer, LinkStats& stats) {
+    const OcTreeKey root_key = tree.coordToKey(point3d(0, 0, 0));
+    const unsigned int tree_depth = tree.getTreeDepth();
+    NodeList want;
+    NodeList level(1, std::make_pair(root_key, 0u));
+    while (!level.empty()) {
+      const std::string reply = exchange(peer, encodeNodes(child_hash_request, level), stats);
+      size_t pos = 0;
+      NodeList next;
+      for (size_t i=0; i<level.size(); i++) {
+        const bool peer_inner = get<uint8_t>(reply, pos);
+        uint64_t peer_hashes[8], hashes[8];
+        if (peer_inner) {
+          std::memcpy(peer_hashes, reply.data() + pos, sizeof(peer_hashes));
+          pos += sizeof(peer_hashes);
+        }
+        if (!peer_inner || !tree.getChildHashes(level[i].first, level[i].second, hashes)) {
+          // a peer leaf, or an inner node we do not have yet: take it whole. A root that is
+          // not inner is an empty peer, with nothing to send.
+          if (peer_inner || level[i].second > 0) want.push_back(level[i]);
+          continue;
+        }
+        const unsigned int child_depth = level[i].second + 1;
+        for (unsigned int c=0; c<8; c++) {
+          // 0 is a child the peer does not know, which leaves ours as it is
+          if (peer_hashes[c] == 0 || peer_hashes[c] == hashes[c]) continue;
+          OcTreeKey child_key;
+          computeChildKey(c, 1 << (tree_depth - 1 - child_depth), level[i].first, child_key);
+          next.push_back(std::make_pair(child_key, child_depth));
+        }
+      }
+      level.swap(next);
+    }
+    if (want.empty())
+      return true;
+
+    std::istringstream s(exchange(peer, encodeNodes(subtree_request, want), stats));
+    tree.mergeBinaryData(s);
+    return !s.fail();
+  }
+
+  void explore(RoughOcTree& tree, unsigned int seed, int num_points, char agent, float x_min, float x_max) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> ux(x_min, x_max), u(-4, 4), r(0, 1);
+    for (int i=0; i<num_points; i++) {
+      OcTreeKey key;
+      if (!tree.coordToKeyChecked(point3d(ux(rng), u(rng), 0.3f * u(rng)), key)) continue;
+      const bool occupied = r(rng) < 0.7;
+      tree.updateNode(key, occupied);
+      if (occupied) {
+        tree.setNodeRough(key, r(rng));
+        tree.setNodeStairLogOdds(key, r(rng) < 0.2 ? 3.0f : -2.0f);
+        tree.setNodeAgent(key, agent);
+      }
+    }
+    tree.updateInnerOccupancy();
+  }
+
+  void configure(RoughOcTree& tree) {
+    tree.setNumBins(16);
+    tree.setStairsEnabled(true);
+    tree.binary_encoding_mode = BINNING;
+    // binning messages do not carry the agent
+    tree.subtree_hash_agent = false;
+    tree.enableSubtreeHashes(true);
+  }
+
+  // Leaves as a binning message carries them, one line each
+  std::string leafDump(RoughOcTree& tree) {
+    std::stringstream s;
+    tree.writeBinaryData(s);
+    RoughOcTree decoded(tree.getResolution());
+    configure(decoded);
+    decoded.readBinaryData(s);
+    std::ostringstream out;
+    for (RoughOcTree::leaf_iterator it = decoded.begin_leafs(), end = decoded.end_leafs(); it != end; ++it) {
+      out << it.getKey()[0] << " " << it.getKey()[1] << " " << it.getKey()[2] << " " << it.getDepth() << " "
+          << decoded.isNodeOccupied(*it) << " " << it->getRough() << " " << it->getStairLogOdds() << "\n";
+    }
+    return out.str();
+  }
+
+}
+
+int main(int argc, char** argv) {
+  const double resolution = 0.1;
+  const int num_points = argc > 1 ? std::atoi(argv[1]) : 40000;
+
+  // The shared map both robots received earlier
+  RoughOcTree shared(resolution);
+  configure(shared);
+  explore(shared, 1, num_points, 1, -4, 4);
+  std::stringstream shared_data;
+  shared.writeBinaryData(shared_data);
+
+  RoughOcTree a(resolution), b(resolution);
+  for (RoughOcTree* tree : {&a, &b}) {
+    configure(*tree);
+    std::stringstream s(shared_data.str());
+    tree->readBinaryData(s);
+  }
+  explore(a, 2, num_points / 20, 2, -4, -2.5f);
+  explore(b, 3, num_points / 20, 3, 2.5f, 4);
+  // both revisit the middle, so some subtrees differ on both sides
+  explore(a, 4, num_points / 80, 2, -1, 1);
+  explore(b, 5, num_points / 80, 3, -1, 1);
+
+  LinkStats to_b, to_a;
+  bool ok = pull(b, a, to_b);
+  ok = pull(a, b, to_a) && ok;
+  // a took b's version of the subtrees both changed; b pulls those back
+  ok = pull(b, a, to_b) && ok;
+
+  const OcTreeKey root_key = a.coordToKey(point3d(0, 0, 0));
+  const bool same_hash = a.getSubtreeHash(root_key, 0) == b.getSubtreeHash(root_key, 0);
+  const bool same_leaves = leafDump(a) == leafDump(b);
+  std::stringstream full;
+  a.writeBinaryData(full);
+  printf("a -> b: %zu bytes in %zu messages, b -> a: %zu bytes in %zu messages, full map %zu bytes\n",
+         to_b.bytes, to_b.messages, to_a.bytes, to_a.messages, full.str().size());
+  printf("root hashes %s, leaves %s\n", same_hash ? "equal" : "DIFFER", same_leaves ? "identical" : "DIFFER");
+  return ok && same_hash && same_leaves ? 0 : 1;
+}